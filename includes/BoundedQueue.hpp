@@ -0,0 +1,137 @@
+#ifndef BOUNDEDQUEUE_HPP
+# define BOUNDEDQUEUE_HPP
+
+# include <atomic>
+# include <chrono>
+# include <cstddef>
+# include <cstdint>
+# include <memory>
+# include <thread>
+
+/**
+ * @brief Lock-free multi-producer / multi-consumer queue with a fixed capacity
+ *
+ * Bounded ring of cells tagged with sequence numbers (Vyukov's MPMC queue):
+ * producers and consumers each claim a position with a single CAS and never
+ * take a lock. push() and pop() back off (spin, yield, then short sleeps) while
+ * the queue is full or empty. After close(), pop() drains the remaining items
+ * and then returns false.
+ */
+template<typename T>
+class BoundedQueue {
+	public:
+		explicit BoundedQueue(size_t capacity)
+			: _mask(roundUp(capacity) - 1), _cells(new t_cell[_mask + 1]) {
+			for (size_t i = 0; i <= _mask; ++i)
+				_cells[i].seq.store(i, std::memory_order_relaxed);
+		}
+
+		BoundedQueue(const BoundedQueue &) = delete;
+		BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+		/**
+		 * @brief Enqueue item, waiting while full. Returns false if the queue is closed.
+		 */
+		bool push(T item) {
+			for (unsigned int spins = 0; !tryPush(item); ++spins) {
+				if (_closed.load(std::memory_order_acquire))
+					return false;
+				backoff(spins);
+			}
+			return true;
+		}
+
+		/**
+		 * @brief Dequeue into out, waiting while empty. Returns false once closed and drained.
+		 */
+		bool pop(T &out) {
+			for (unsigned int spins = 0; !tryPop(out); ++spins) {
+				// Items pushed before close() are visible once the flag is: drain them
+				if (_closed.load(std::memory_order_acquire))
+					return tryPop(out);
+				backoff(spins);
+			}
+			return true;
+		}
+
+		/**
+		 * @brief Enqueue item only if a slot is immediately free. item is left untouched on failure.
+		 */
+		bool tryPush(T &item) {
+			size_t pos = _tail.load(std::memory_order_relaxed);
+			for (;;) {
+				t_cell &cell = _cells[pos & _mask];
+				size_t seq = cell.seq.load(std::memory_order_acquire);
+				intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+				if (diff == 0) {
+					if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+						cell.value = std::move(item);
+						cell.seq.store(pos + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0)
+					return false;
+				else
+					pos = _tail.load(std::memory_order_relaxed);
+			}
+		}
+
+		/**
+		 * @brief Dequeue into out only if an item is immediately available.
+		 */
+		bool tryPop(T &out) {
+			size_t pos = _head.load(std::memory_order_relaxed);
+			for (;;) {
+				t_cell &cell = _cells[pos & _mask];
+				size_t seq = cell.seq.load(std::memory_order_acquire);
+				intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+				if (diff == 0) {
+					if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+						out = std::move(cell.value);
+						cell.seq.store(pos + _mask + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0)
+					return false;
+				else
+					pos = _head.load(std::memory_order_relaxed);
+			}
+		}
+
+		/**
+		 * @brief Signal that no more items will be pushed. Call once all producers are done.
+		 */
+		void close() {
+			_closed.store(true, std::memory_order_release);
+		}
+	private:
+		typedef struct s_cell
+		{
+			std::atomic<size_t>	seq;
+			T					value;
+		}	t_cell;
+
+		const size_t				_mask;
+		std::unique_ptr<t_cell[]>	_cells;
+		alignas(64) std::atomic<size_t>	_head{0};
+		alignas(64) std::atomic<size_t>	_tail{0};
+		alignas(64) std::atomic<bool>	_closed{false};
+
+		static size_t roundUp(size_t n) {
+			size_t p = 2;
+			while (p < n)
+				p <<= 1;
+			return p;
+		}
+
+		static void backoff(unsigned int spins) {
+			if (spins < 64)
+				std::this_thread::yield();
+			else
+				std::this_thread::sleep_for(std::chrono::microseconds(spins < 256 ? 50 : 1000));
+		}
+};
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef CONTENTHASH_HPP
+# define CONTENTHASH_HPP
+
+# include <cstddef>
+# include <cstdint>
+# include <mutex>
+# include <unordered_map>
+
+/**
+ * @brief Fast non-cryptographic 64-bit hash of a byte buffer (XXH64)
+ */
+uint64_t	contentHash(const void *data, size_t size, uint64_t seed = 0);
+
+/**
+ * @brief Thread-safe map from the content hash of a raw cover payload to its image id
+ *
+ * Lets exact duplicate payloads, such as the same APIC embedded in every track
+ * of an album, reuse the result of the first decode. The map is split into
+ * shards with their own lock so concurrent workers rarely contend.
+ */
+class DigestIndex {
+	public:
+		bool find(uint64_t digest, uint32_t &id) const;
+		void insert(uint64_t digest, uint32_t id);
+		void erase(uint64_t digest);
+	private:
+		static const size_t	SHARDS = 64;
+
+		typedef struct alignas(64) s_shard
+		{
+			mutable std::mutex						mutex;
+			std::unordered_map<uint64_t, uint32_t>	ids;
+		}	t_shard;
+
+		t_shard	_shards[SHARDS];
+
+		t_shard &shard(uint64_t digest);
+		const t_shard &shard(uint64_t digest) const;
+};
+
+#endif
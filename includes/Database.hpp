@@ -1,10 +1,12 @@
 #ifndef DATABASE_HPP
 #define DATABASE_HPP
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <sqlite3.h>
 #include <optional>
+#include <unordered_map>
 
 struct SongRecord {
 	std::string id;
@@ -17,6 +19,20 @@ struct SongRecord {
 	std::string path;
 };
 
+struct FileState {
+	std::string path;
+	std::string id;
+	long long size;
+	long long mtime;
+	long long inode;
+};
+
+struct CoverRecord {
+	int id;
+	uint64_t hash; // Perceptual hash, stored bit for bit as a signed INTEGER
+	std::string path; // Relative to IMG_DIR
+};
+
 struct LogAddition {
 	int id;
 	int year;
@@ -27,31 +43,66 @@ struct LogAddition {
 	std::string comment;
 };
 
+/**
+ * @brief Connection tuning applied by Database::open(), read from .env (SQLITE_*)
+ *
+ * The defaults let the web frontend keep reading songs.db during an ingest (WAL)
+ * without paying an fsync per commit. bulkLoad trades durability for speed on
+ * initial imports. On a database without songs yet, it also defers secondary
+ * index creation to the end of the run.
+ */
+struct DbConfig {
+	std::string journalMode = "WAL";
+	std::string synchronous = "NORMAL";
+	long long mmapSize = 256LL * 1024 * 1024;
+	long long cacheSize = -64 * 1024; // Negative: KiB instead of pages
+	int pageSize = 4096; // Only applies to a database created by this connection
+	int busyTimeout = 5000; // ms
+	bool bulkLoad = false;
+};
+
 class Database {
 	public:
-		explicit Database(const std::string &filename);
+		explicit Database(const std::string &filename, const DbConfig &config = DbConfig());
 		~Database();
 
 		bool open();
 		void close();
 
 		bool initSchema();
+		bool createIndexes();
 
 		bool upsertSong(const SongRecord &song, bool &isNew);
-		std::vector<SongRecord> fetchSongsWithNullCover();
+		std::vector<std::string> fetchPathsWithNullCover();
+
+		bool insertLogAddition(LogAddition &log);
+		bool updateLogAddition(const LogAddition &log);
+
+		std::vector<CoverRecord> fetchCovers();
+		bool insertCover(const CoverRecord &cover);
+		bool clearCover(int id);
 
-		bool insertLogAddition(const LogAddition &log);
+		std::vector<FileState> fetchFileStates();
+		bool upsertFileState(const FileState &state);
 
 		bool beginTransaction();
 		bool commitTransaction();
+		bool rollbackTransaction();
 
 		unsigned int getLastSongId();
+		unsigned int getLastCoverId();
 	private:
 		sqlite3 *_db = nullptr;
 		std::string _path;
+		DbConfig _config;
+		std::unordered_map<std::string, sqlite3_stmt*> _statements;
 
 		bool execute(const std::string &sql);
+		bool hasSongs();
+		bool applyConfig();
 		std::optional<sqlite3_stmt*> prepare(const std::string &sql);
+		std::optional<sqlite3_stmt*> cached(const std::string &sql);
+		static void release(sqlite3_stmt *stmt);
 };
 
 #endif
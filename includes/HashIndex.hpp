@@ -0,0 +1,42 @@
+#ifndef HASHINDEX_HPP
+# define HASHINDEX_HPP
+
+# include <cstdint>
+# include <string>
+# include <unordered_map>
+
+/**
+ * @brief Cached perceptual hash of an image file, valid while size and mtime match
+ */
+typedef struct s_hashEntry
+{
+	uint64_t	size;
+	int64_t		mtime;
+	uint64_t	hash;
+}	t_hashEntry;
+
+/**
+ * @brief Persistent image path -> perceptual hash cache
+ *
+ * The whole file is read with a single sequential read on load(). Lookups are
+ * served from the loaded entries; only entries passed to update() during this
+ * run are written back by save(), so deleted images drop out of the index.
+ */
+class HashIndex {
+	public:
+		explicit HashIndex(const std::string &filename);
+
+		bool load();
+		bool save() const;
+
+		const t_hashEntry *lookup(const std::string &name, uint64_t size, int64_t mtime) const;
+		void update(const std::string &name, const t_hashEntry &entry);
+
+		size_t loadedCount() const;
+	private:
+		std::string _path;
+		std::unordered_map<std::string, t_hashEntry> _loaded;
+		std::unordered_map<std::string, t_hashEntry> _current;
+};
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef HASHSTORE_HPP
+# define HASHSTORE_HPP
+
+# include <cstddef>
+# include <cstdint>
+# include <shared_mutex>
+# include <vector>
+
+/**
+ * @brief Side of the grayscale thumbnail perceptualHash() expects
+ */
+# define PHASH_THUMB_SIZE 32
+
+/**
+ * @brief DCT perceptual hash of a PHASH_THUMB_SIZE x PHASH_THUMB_SIZE grayscale thumbnail.
+ *
+ * Same result as cv::img_hash::PHash on that thumbnail: DCT-II of the float
+ * pixels, top-left 8x8 coefficients with DC zeroed, each compared against their
+ * mean. Bit (8 * row + col) is set when coefficient (row, col) is above it, the
+ * layout of PHash::compute output read as a little-endian word. Only those 64
+ * coefficients are computed.
+ *
+ * @param pixels First pixel of the thumbnail.
+ * @param stride Bytes between the starts of two rows.
+ */
+uint64_t	perceptualHash(const uint8_t *pixels, size_t stride);
+
+/**
+ * @brief Find the first hash whose Hamming distance to query is below threshold.
+ *
+ * Dispatches once at runtime to an AVX-512 (VPOPCNTQ), AVX2 (nibble LUT) or
+ * scalar popcount kernel depending on what the CPU supports.
+ *
+ * @param hashes Contiguous array of packed hashes.
+ * @param count Number of hashes in the array.
+ * @param query Packed hash to compare against.
+ * @param threshold Strict upper bound on the Hamming distance.
+ * @return Index of the first match, or count if there is none.
+ */
+size_t	hammingFindFirst(const uint64_t *hashes, size_t count, uint64_t query, unsigned int threshold);
+
+/**
+ * @brief Thread-safe store of 64-bit perceptual hashes with a near-duplicate index
+ *
+ * Hashes are kept in one contiguous array and indexed with multi-index hashing:
+ * each hash is split into four 16-bit chunks, one bucket table per chunk. Two
+ * hashes closer than the threshold must agree on at least one chunk up to
+ * (threshold - 1) / 4 flipped bits, so a lookup only probes a handful of buckets
+ * instead of scanning the whole store. Lookups share a reader lock; inserts take
+ * it exclusively.
+ *
+ * Every hash carries the numeric id of the cover image it was computed from.
+ * New ids are reserved by insertUnique() under the same lock as the duplicate
+ * check, so callers can encode and write the image without holding any lock.
+ */
+class HashStore {
+	public:
+		explicit HashStore(unsigned int threshold);
+
+		void reserve(size_t n);
+
+		/**
+		 * @brief Append a hash without checking for duplicates.
+		 *
+		 * Ids handed out by insertUnique() afterwards are always greater than id.
+		 */
+		void push(uint64_t hash, uint32_t id);
+
+		/**
+		 * @brief Ids handed out by insertUnique() afterwards are greater than last.
+		 */
+		void skipIds(uint32_t last);
+
+		/**
+		 * @brief Insert hash and reserve a new image id unless a near duplicate is stored.
+		 *
+		 * The check and the reservation are atomic with respect to other callers.
+		 *
+		 * @param hash Packed hash to insert.
+		 * @param id Set to the reserved id, or to the matching id on duplicate.
+		 * @return true if the hash was inserted.
+		 */
+		bool insertUnique(uint64_t hash, uint32_t &id);
+
+		/**
+		 * @brief Drop a reserved hash whose image could not be saved.
+		 *
+		 * Its id is not reused, so a later image never overwrites a stale file.
+		 */
+		void erase(uint64_t hash, uint32_t id);
+	private:
+		static const unsigned int	CHUNKS = 4;
+		static const unsigned int	CHUNK_BITS = 16;
+		static const size_t			LINEAR_SCAN_MAX = 4096; // Below this a SIMD scan beats probing
+
+		/**
+		 * @brief Bucket entry; the hash is duplicated so probing stays in one cache line
+		 */
+		typedef struct s_slot
+		{
+			uint64_t	hash;
+			uint32_t	index;
+		}	t_slot;
+
+		unsigned int							_threshold;
+		std::vector<uint16_t>					_probes;
+		std::vector<uint64_t>					_hashes;
+		std::vector<uint32_t>					_ids;
+		std::vector<std::vector<t_slot> >		_tables[CHUNKS];
+		uint32_t								_nextId = 1;
+		size_t									_erasures = 0;
+		mutable std::shared_mutex				_mutex;
+
+		long findNearLocked(uint64_t hash) const;
+		void pushLocked(uint64_t hash, uint32_t id);
+		std::vector<t_slot> &bucket(unsigned int chunk, uint64_t hash);
+};
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef ID3READER_HPP
+# define ID3READER_HPP
+
+# include <cstddef>
+# include <cstdint>
+# include <string>
+# include <string_view>
+
+/**
+ * @brief Frames of an ID3v2 tag the song pipeline needs, as views into the tag bytes
+ *
+ * Text views hold the raw frame payload, encoding byte included: decode them
+ * with id3Text(). id42 is the bare value, decoded with its own encoding.
+ * picture is the image data of the first APIC frame.
+ */
+typedef struct s_id3Tag
+{
+	std::string_view	title;		// TIT2
+	std::string_view	artist;		// TPE1
+	std::string_view	album;		// TALB
+	std::string_view	genre;		// TCON
+	std::string_view	id42;		// Value of the TXXX frame described "42id"
+	uint8_t				id42Encoding;
+	std::string_view	picture;	// APIC image data
+	bool				has42id;
+	size_t				audioStart;	// First byte after the tag (and its footer)
+}	t_id3Tag;
+
+/**
+ * @brief Read the ID3v2.3/2.4 tag at the start of data without copying it.
+ *
+ * Only plain frames are understood: unsynchronised, compressed, encrypted or
+ * grouped frames, ID3v2.2 tags and v2.3 numeric genre references make it give
+ * up so the caller can fall back to TagLib.
+ *
+ * @return false if data does not start with a tag this reader fully understands.
+ */
+bool	readId3v2(const char *data, size_t size, t_id3Tag &tag);
+
+/**
+ * @brief Decode a text payload (encoding byte + text) to UTF-8.
+ *
+ * Multiple values are joined with a space, like TagLib's Frame::toString().
+ */
+std::string	id3Text(std::string_view payload);
+
+/**
+ * @brief Decode text stored with the given encoding (0 Latin-1, 1 UTF-16, 2 UTF-16BE, 3 UTF-8) to UTF-8
+ */
+std::string	id3Text(uint8_t encoding, std::string_view text);
+
+/**
+ * @brief Length of the MPEG audio stream in milliseconds.
+ *
+ * Uses the Xing/Info or VBRI frame count when the first frame carries one,
+ * otherwise the bitrate of the first frame, the way TagLib's MPEG::Properties
+ * does.
+ *
+ * @param data Whole file.
+ * @param size File size.
+ * @param audio_start Offset to start looking for the first frame from.
+ * @return The length, or -1 if no valid frame is found.
+ */
+long	mpegLengthMs(const char *data, size_t size, size_t audio_start);
+
+#endif
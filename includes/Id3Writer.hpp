@@ -0,0 +1,23 @@
+#ifndef ID3WRITER_HPP
+# define ID3WRITER_HPP
+
+# include <string>
+
+/**
+ * @brief Add a TXXX frame to the ID3v2.3/2.4 tag of a file without TagLib.
+ *
+ * The frame goes into the tag's padding with a single pwrite when it fits, so
+ * nothing else in the file moves. Otherwise the tag is rebuilt once with a
+ * generous padding reserve into a temporary file that replaces the original,
+ * so later tag edits fit in place again. Symlinks are resolved first, so the
+ * file they point to is the one replaced. Other tags (ID3v1, APE) are left
+ * untouched either way.
+ *
+ * @return false if the tag is not one this writer handles (no ID3v2.3/2.4 tag,
+ * unsynchronisation, extended header or footer), if the tag must grow in a
+ * file with several hard links, or on I/O failure. The file is left unchanged
+ * in that case; callers fall back to an in-place save.
+ */
+bool	addId3UserText(const std::string &path, const std::string &description, const std::string &value);
+
+#endif
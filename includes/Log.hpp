@@ -0,0 +1,33 @@
+#ifndef LOG_HPP
+# define LOG_HPP
+
+# include <string>
+
+/**
+ * @brief Logs a message with current time timestamp [HH:MM:SS.ms]
+ *
+ * Queued for the logger thread once startLogger() was called: info messages
+ * that do not go to the console are dropped rather than waited for when the
+ * queue is full.
+ *
+ * @param message The string message to log
+ * @param console If true, also prints to console
+ */
+void	log(std::string message, bool console);
+
+/**
+ * @brief Logs an error to stderr with a timestamp, through the logger thread once started
+ */
+void	logError(std::string message);
+
+/**
+ * @brief Start the logger thread: log() and logError() stop writing synchronously
+ */
+void	startLogger();
+
+/**
+ * @brief Flush pending messages and stop the logger thread
+ */
+void	stopLogger();
+
+#endif
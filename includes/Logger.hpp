@@ -0,0 +1,80 @@
+#ifndef LOGGER_HPP
+# define LOGGER_HPP
+
+# include <atomic>
+# include <cstdint>
+# include <ctime>
+# include <fstream>
+# include <mutex>
+# include <string>
+# include <thread>
+
+# include "BoundedQueue.hpp"
+
+# define LOG_QUEUE_SIZE 8192 // Messages buffered for the flusher before the drop/backpressure policy applies
+# define LOG_BATCH_SIZE 256 // Max messages written by the flusher in one write per stream
+
+/**
+ * @brief Asynchronous logger writing an info file, stderr and the console from one thread
+ *
+ * Callers only take a millisecond timestamp and push the message on a lock-free
+ * queue (the repo's BoundedQueue, used here with many producers and a single
+ * consumer). The flusher thread formats the "[HH:MM:SS.mmm] " prefix, caching
+ * it until the next millisecond, and writes each stream once per batch.
+ *
+ * When the queue is full, plain info messages are dropped and counted, while
+ * errors and console messages wait for room: losing them would hide failures
+ * or leave the user without output. The drop count is logged by stop().
+ *
+ * Before start() and after stop(), messages are written synchronously. A
+ * Logger is started at most once.
+ */
+class Logger {
+	public:
+		typedef enum e_stream {
+			INFO,	// Info file, and the console when asked
+			ERROR	// stderr (errors.log once redirected)
+		}	t_stream;
+
+		/**
+		 * @param info Info log file, owned by the caller and written only by the flusher while started
+		 * @param console_mutex Serializes console output with the progress bar
+		 */
+		Logger(std::ofstream &info, std::mutex &console_mutex);
+		~Logger();
+
+		Logger(const Logger &) = delete;
+		Logger &operator=(const Logger &) = delete;
+
+		void start();
+		void stop();
+
+		void write(t_stream stream, std::string message, bool console);
+	private:
+		typedef struct s_entry
+		{
+			int64_t		ms;	// Wall clock time of the call, in ms since the epoch
+			t_stream	stream;
+			bool		console;
+			std::string	text;
+		}	t_entry;
+
+		std::ofstream			&_info;
+		std::mutex				&_consoleMutex;
+		std::mutex				_writeMutex;	// Held by whoever writes the streams: the flusher, or callers when not started
+		BoundedQueue<t_entry>	_queue;
+		std::thread				_flusher;
+		std::atomic<bool>		_started{false};
+		std::atomic<size_t>		_dropped{0};
+		int64_t					_stampMs = -1;	// Last prefix formatted by stamp()
+		std::time_t				_stampSec = -1;
+		char					_stamp[17];
+
+		void run();
+		void drain();
+		void format(const t_entry &entry, std::string &info, std::string &error, std::string &console);
+		const char *stamp(int64_t ms);
+		void flush(const std::string &info, const std::string &error, const std::string &console);
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef MAPPEDSTREAM_HPP
+# define MAPPEDSTREAM_HPP
+
+# include <cstddef>
+# include <string>
+# include <taglib/taglib.h>
+# include <taglib/tiostream.h>
+
+// IOStream offsets and sizes changed from long / unsigned long to offset_t / size_t in TagLib 2
+# if TAGLIB_MAJOR_VERSION >= 2
+typedef TagLib::offset_t	t_streamOffset;
+typedef TagLib::offset_t	t_streamStart;
+typedef size_t				t_streamLength;
+# else
+typedef long				t_streamOffset;
+typedef unsigned long		t_streamStart;
+typedef unsigned long		t_streamLength;
+# endif
+
+/**
+ * @brief Read-only TagLib stream over a memory-mapped file
+ *
+ * TagLib's FileStream issues many small buffered reads while it looks for tags
+ * and frame headers, each one a round-trip on network mounts. Mapping the file
+ * turns them into memory accesses served by the kernel's readahead. Writes are
+ * rejected: files that need saving are reopened with a regular FileStream.
+ */
+class MappedStream : public TagLib::IOStream {
+	public:
+		explicit MappedStream(const std::string &path);
+		~MappedStream() override;
+
+		MappedStream(const MappedStream &) = delete;
+		MappedStream &operator=(const MappedStream &) = delete;
+
+		TagLib::FileName name() const override;
+		TagLib::ByteVector readBlock(t_streamLength length) override;
+		void writeBlock(const TagLib::ByteVector &data) override;
+		void insert(const TagLib::ByteVector &data, t_streamStart start = 0, t_streamLength replace = 0) override;
+		void removeBlock(t_streamStart start = 0, t_streamLength length = 0) override;
+		bool readOnly() const override;
+		bool isOpen() const override;
+		void seek(t_streamOffset offset, Position p = Beginning) override;
+		t_streamOffset tell() const override;
+		t_streamOffset length() override;
+		void truncate(t_streamOffset length) override;
+
+		/**
+		 * @brief The whole mapped file, valid as long as the stream
+		 */
+		const char *data() const;
+		size_t size() const;
+	private:
+		std::string	_path;
+		const char	*_data = nullptr;
+		size_t		_size = 0;
+		size_t		_pos = 0;
+};
+
+#endif
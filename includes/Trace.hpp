@@ -0,0 +1,92 @@
+#ifndef TRACE_HPP
+# define TRACE_HPP
+
+# include <atomic>
+# include <chrono>
+# include <cstdint>
+# include <mutex>
+# include <string>
+
+# define TRACE_RESERVE_EVENTS 4096 // Events preallocated per thread on its first span
+
+/**
+ * @brief Set once by startTracing(); spans cost one relaxed load while it is false
+ */
+extern std::atomic<bool>	g_traceEnabled;
+
+/**
+ * @brief Start recording spans. Call before the threads to trace are started.
+ */
+void	startTracing();
+
+/**
+ * @brief Microseconds since startTracing(), on the steady clock
+ */
+int64_t	traceNow();
+
+/**
+ * @brief Record a completed span in the calling thread's buffer
+ *
+ * @param name Static string: only the pointer is kept until writeTrace().
+ * @param category "span" for work, "lock" for time spent waiting on a mutex.
+ */
+void	traceRecord(const char *name, const char *category, int64_t start, int64_t end);
+
+/**
+ * @brief Name the calling thread in the trace (static string)
+ */
+void	traceThreadName(const char *name);
+
+/**
+ * @brief Write every recorded span as Chrome trace event JSON, loadable in Perfetto
+ *
+ * Reads all thread buffers without locking them: call once the traced threads
+ * were joined.
+ */
+bool	writeTrace(const std::string &path);
+
+/**
+ * @brief Records the lifetime of a scope as a span of the calling thread
+ */
+class TraceSpan {
+	public:
+		explicit TraceSpan(const char *name)
+			: _name(name), _start(g_traceEnabled.load(std::memory_order_relaxed) ? traceNow() : -1) {}
+		~TraceSpan() {
+			if (_start >= 0)
+				traceRecord(_name, "span", _start, traceNow());
+		}
+
+		TraceSpan(const TraceSpan &) = delete;
+		TraceSpan &operator=(const TraceSpan &) = delete;
+	private:
+		const char	*_name;
+		int64_t		_start;
+};
+
+# define TRACE_CONCAT_(a, b) a##b
+# define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+# define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name)
+
+/**
+ * @brief Lock mutex with a Lock (std::unique_lock, std::shared_lock), recording the wait if any
+ *
+ * An uncontended lock is taken by the try-lock alone and records nothing, so
+ * the trace only shows real stalls, as "lock" spans named after the mutex.
+ */
+template<typename Lock, typename Mutex>
+Lock	traceLock(Mutex &mutex, const char *name)
+{
+	Lock lock(mutex, std::try_to_lock);
+
+	if (!lock.owns_lock())
+	{
+		const int64_t start = g_traceEnabled.load(std::memory_order_relaxed) ? traceNow() : -1;
+		lock.lock();
+		if (start >= 0)
+			traceRecord(name, "lock", start, traceNow());
+	}
+	return lock;
+}
+
+#endif
@@ -3,9 +3,11 @@
 
 # include <atomic>
 # include <chrono>
+# include <condition_variable>
 # include <cstdlib>
 # include <fcntl.h>
 # include <filesystem>
+# include <functional>
 # include <fstream>
 # include <iomanip>
 # include <iostream>
@@ -18,7 +20,6 @@
 
 # pragma GCC diagnostic ignored "-Woverloaded-virtual"
 	# include <opencv2/opencv.hpp>
-	# include <opencv2/img_hash.hpp>
 # pragma GCC diagnostic pop
 
 #include <taglib/attachedpictureframe.h>
@@ -26,14 +27,21 @@
 # include <taglib/mpegfile.h>
 # include <taglib/textidentificationframe.h>
 
+# include "Database.hpp"
+# include "Log.hpp"
+# include "HashStore.hpp"
+
 # define PROGRESS_BAR_WIDTH 60
+# define PROGRESS_TICK_MS 100 // Interval between two redraws of the progress bar
 # define PIC_QUALITY 512 // 512 is a good compromise between quality and size for images
 # define HAMMING_THRESHOLD 8 // Threshold for perceptual hash similarity
-
-/**
- * @brief Atomic counter for progress tracking
- */
-extern std::atomic<size_t>						g_progressCount;
+# define SCAN_BUFFER_SIZE (64 * 1024) // Bytes of directory entries fetched per getdents64 call
+# define DB_QUEUE_SIZE 4096 // Processed songs buffered for the DB writer before workers block
+# define DB_BATCH_SIZE 1024 // Max rows committed per transaction by the DB writer
+# define ID_BLOCK_SIZE 1024 // 42ids persisted in log_additions at once, before any of them is written to a file
+# define PIPELINE_QUEUE_SIZE 64 // Songs buffered between two pipeline stages, bounds cover memory in flight
+# define PREFETCH_BYTES (1 << 20) // Head of a song read ahead before parsing (ID3v2 tag, first frames)
+# define PREFETCH_TAIL_BYTES 4096 // Tail of a song read ahead before parsing (ID3v1/APE tags)
 
 /**
  * @brief Global start time for measuring elapsed time
@@ -47,24 +55,112 @@ typedef struct s_paths
 	std::string	root;
 }	t_paths;
 
-typedef struct s_stats
+/**
+ * @brief Number of threads of each song ingestion pipeline stage
+ */
+typedef struct s_pipeline
+{
+	unsigned int	scanThreads;
+	unsigned int	readThreads;
+	unsigned int	parseThreads;
+	unsigned int	imageThreads;
+	unsigned int	encodeThreads;
+	unsigned int	tagWriteThreads;
+}	t_pipeline;
+
+/**
+ * @brief How song covers are scaled down to PIC_QUALITY
+ */
+typedef struct s_imageConfig
+{
+	int	resizeKernel;	// cv::INTER_* interpolation used by the final resize
+}	t_imageConfig;
+
+/**
+ * @brief Counters of a single thread, alone on its cache line
+ *
+ * Only the owning thread writes them (see addStat()); the progress reporter
+ * reads them while they change, so they are relaxed atomics but never contended.
+ */
+typedef struct alignas(64) s_stats
+{
+	std::atomic<size_t>	processed{0};	// Items done, whichever way they ended
+	std::atomic<size_t>	newFiles{0};
+	std::atomic<size_t>	updatedFiles{0};
+	std::atomic<size_t>	newImages{0};
+	std::atomic<size_t>	unchanged{0};
+	std::atomic<size_t>	errors{0};
+}	t_stats;
+
+/**
+ * @brief Sum of the counters of all threads at one point in time
+ */
+typedef struct s_statsTotal
 {
+	size_t	processed;
 	size_t	newFiles;
 	size_t	updatedFiles;
 	size_t	newImages;
+	size_t	unchanged;
 	size_t	errors;
-}	t_stats;
+}	t_statsTotal;
 
-extern std::mutex			g_statsMutex;
-extern t_stats				g_stats;
 extern std::ofstream		g_logFile;
 
+/**
+ * @brief Counters of the calling thread, registered on its first call
+ */
+t_stats	&threadStats();
+
+/**
+ * @brief Adds the counters of every thread that ever called threadStats()
+ */
+t_statsTotal	sumStats();
+
+/**
+ * @brief Bump a counter of threadStats(): a plain load and store, no locked instruction
+ */
+inline void	addStat(std::atomic<size_t> &counter, size_t n = 1)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Redraws the progress bar every PROGRESS_TICK_MS from its own thread
+ *
+ * Progress counts the items processed (see t_stats::processed) since the
+ * reporter was created, out of total, which may still grow while it runs.
+ * Workers only bump their counters and never touch the terminal. The destructor
+ * stops the thread, draws the bar one last time at total/total and ends its
+ * line.
+ */
+class ProgressReporter {
+	public:
+		explicit ProgressReporter(const std::atomic<size_t> &total);
+		~ProgressReporter();
+
+		ProgressReporter(const ProgressReporter &) = delete;
+		ProgressReporter &operator=(const ProgressReporter &) = delete;
+	private:
+		const std::atomic<size_t>	&_total;
+		size_t						_base;
+		bool						_stop = false;
+		std::mutex					_mutex;
+		std::condition_variable		_wake;
+		std::thread					_thread;
+
+		void	run();
+};
+
 
 /**
  * @brief Prints a console progress bar with estimated remaining time.
  * 
  * Shows current progress out of total, a 60-character bar, percentage,
- * and estimated time left based on elapsed time from global g_startTime.
+ * the summed thread counters and estimated time left. Keeps its ETA state in
+ * statics: call it from a single thread, normally a ProgressReporter. The
+ * estimate restarts when current is 0 only, not when a growing total makes
+ * the percentage drop.
  * 
  * @param current Current progress step (0 to total).
  * @param total Total number of steps.
@@ -72,17 +168,48 @@ extern std::ofstream		g_logFile;
 void	displayProgress(const size_t current, const size_t total);
 
 /**
- * @brief Logs a message with current time timestamp [HH:MM:SS.ms]
+ * @brief Reads the .env file and returns a t_paths struct with images and songs paths
+ */
+t_paths	getPathsFromEnv(const std::string &env_path);
+
+/**
+ * @brief Reads the SQLITE_* settings of the .env file, keeping defaults for missing keys
  *
- * @param message The string message to log
- * @param console If true, also prints to console
+ * Keys: SQLITE_JOURNAL_MODE, SQLITE_SYNCHRONOUS, SQLITE_MMAP_SIZE, SQLITE_CACHE_SIZE,
+ * SQLITE_PAGE_SIZE, SQLITE_BUSY_TIMEOUT and SQLITE_BULK_LOAD (0/1).
  */
-void	log(std::string message, bool console);
+DbConfig	getDbConfigFromEnv(const std::string &env_path);
 
 /**
- * @brief Reads the .env file and returns a t_paths struct with images and songs paths
+ * @brief Reads the *_THREADS settings of the .env file, sizing missing ones from the core count
+ *
+ * Keys: SCAN_THREADS, READ_THREADS, PARSE_THREADS, IMAGE_THREADS, ENCODE_THREADS and TAGWRITE_THREADS.
  */
-t_paths	getPathsFromEnv(const std::string &env_path);
+t_pipeline	getPipelineFromEnv(const std::string &env_path);
+
+/**
+ * @brief Reads the cover resampling settings of the .env file
+ *
+ * Keys: RESIZE_KERNEL (AREA, CUBIC or LANCZOS, default LANCZOS).
+ */
+t_imageConfig	getImageConfigFromEnv(const std::string &env_path);
+
+/**
+ * @brief Perceptual hash of a decoded image (BGR or grayscale) of any size
+ *
+ * Bit-exact with cv::img_hash::PHash::compute on the same image: the image is
+ * resized to a PHASH_THUMB_SIZE thumbnail with INTER_LINEAR_EXACT, converted to
+ * gray and hashed by perceptualHash().
+ */
+uint64_t	coverHash(const cv::Mat &image);
+
+/**
+ * @brief Path of a cover relative to IMG_DIR, derived from its perceptual hash
+ *
+ * Two levels of fan-out on the first hex digits ("ab/cd/abcd...jpg") keep every
+ * directory small whatever the size of the library.
+ */
+std::string	coverPath(uint64_t hash);
 
 /**
  * @brief Redirects stderr to a file
@@ -92,57 +219,30 @@ t_paths	getPathsFromEnv(const std::string &env_path);
 void	redirectStderrToFile(const std::string &filepath);
 
 /**
- * @brief Recursively find files with a given extension
+ * @brief Recursively find files with a given extension, streaming them as they are found
+ *
+ * Directories are read with getdents64 by several threads at once. The entry
+ * type it returns avoids a stat per entry; only symlinks and file systems that
+ * do not report types are stat'ed. Symlinks to files are followed but
+ * symlinked directories are not entered. on_file is called
+ * concurrently from the scanning threads, in no particular order. A missing
+ * start_path is created, and there is nothing to scan.
  *
  * @param start_path Path to start the search
- * @param extension File extension to match (e.g. ".txt")
- * @return std::vector<StringType> A vector of file paths with the specified extension
+ * @param extension File extension to match (e.g. ".mp3")
+ * @param threads Number of directories read in parallel
+ * @param on_file Called with the path of every matching file
  */
-template<typename StringType>
-std::vector<StringType> getFiles(const std::string &path, const std::string &extension)
-{
-	std::vector<StringType> result;
-
-	try {
-		if (!std::filesystem::exists(path))
-		{
-			if (!std::filesystem::create_directories(path))
-			{
-				std::cerr << "Failed to create directory: " << path << "\n";
-				return result;
-			}
-		}
-
-		std::error_code ec;
-		std::filesystem::recursive_directory_iterator it(path, std::filesystem::directory_options::skip_permission_denied, ec);
-		std::filesystem::recursive_directory_iterator end;
-
-		while (it != end)
-		{
-			if (ec)
-			{
-				std::cerr << "Error while iterating: " << ec.message() << "\n";
-				break;
-			}
-
-			if (it->is_regular_file(ec) && it->path().extension() == extension)
-				result.push_back(StringType(it->path().string()));
-
-			it.increment(ec);
-		}
-	}
-	catch (const std::filesystem::filesystem_error &e)
-	{
-		std::cerr << "Filesystem error: " << e.what() << "\n";
-	}
-	catch (const std::exception &e)
-	{
-		std::cerr << "Unexpected error: " << e.what() << "\n";
-	}
-
-	return result;
-}
+void	scanFiles(const std::string &start_path, const std::string &extension, unsigned int threads,
+					const std::function<void(std::string &&)> &on_file);
 
-void	processSongs(const t_paths &paths, std::vector<cv::Mat> &hashes);
+/**
+ * @brief Ingest songs: tag new files with a 42id, save new covers and update songs.db.
+ *
+ * @param backfill Instead of scanning SONGS_DIR, reprocess only the songs of
+ * songs.db that have no cover yet, whether or not their file changed.
+ */
+void	processSongs(const t_paths &paths, const DbConfig &db_config, const t_pipeline &pipeline,
+						const t_imageConfig &image_config, HashStore &hashes, bool backfill);
 
 #endif
@@ -0,0 +1,135 @@
+#include "ContentHash.hpp"
+#include "Trace.hpp"
+#include <cstring>
+
+static const uint64_t	PRIME1 = 11400714785074694791ULL;
+static const uint64_t	PRIME2 = 14029467366897019727ULL;
+static const uint64_t	PRIME3 = 1609587929392839161ULL;
+static const uint64_t	PRIME4 = 9650029242287828579ULL;
+static const uint64_t	PRIME5 = 2870177450012600261ULL;
+
+static inline uint64_t	rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t	read64(const uint8_t *p)
+{
+	uint64_t	v;
+
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t	read32(const uint8_t *p)
+{
+	uint32_t	v;
+
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t	mixRound(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME2;
+	acc = rotl(acc, 31);
+	return acc * PRIME1;
+}
+
+static inline uint64_t	mergeRound(uint64_t acc, uint64_t val)
+{
+	acc ^= mixRound(0, val);
+	return acc * PRIME1 + PRIME4;
+}
+
+uint64_t	contentHash(const void *data, size_t size, uint64_t seed)
+{
+	const uint8_t	*p = static_cast<const uint8_t *>(data);
+	const uint8_t	*end = p + size;
+	uint64_t		h;
+
+	if (size >= 32)
+	{
+		// Four independent lanes over 32-byte stripes
+		uint64_t	v1 = seed + PRIME1 + PRIME2;
+		uint64_t	v2 = seed + PRIME2;
+		uint64_t	v3 = seed;
+		uint64_t	v4 = seed - PRIME1;
+
+		for (; end - p >= 32; p += 32)
+		{
+			v1 = mixRound(v1, read64(p));
+			v2 = mixRound(v2, read64(p + 8));
+			v3 = mixRound(v3, read64(p + 16));
+			v4 = mixRound(v4, read64(p + 24));
+		}
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = mergeRound(h, v1);
+		h = mergeRound(h, v2);
+		h = mergeRound(h, v3);
+		h = mergeRound(h, v4);
+	}
+	else
+		h = seed + PRIME5;
+
+	h += static_cast<uint64_t>(size);
+	for (; end - p >= 8; p += 8)
+	{
+		h ^= mixRound(0, read64(p));
+		h = rotl(h, 27) * PRIME1 + PRIME4;
+	}
+	if (end - p >= 4)
+	{
+		h ^= static_cast<uint64_t>(read32(p)) * PRIME1;
+		h = rotl(h, 23) * PRIME2 + PRIME3;
+		p += 4;
+	}
+	for (; p < end; ++p)
+	{
+		h ^= (*p) * PRIME5;
+		h = rotl(h, 11) * PRIME1;
+	}
+
+	// Final avalanche
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+bool DigestIndex::find(uint64_t digest, uint32_t &id) const {
+	const t_shard &s = shard(digest);
+	auto lock = traceLock<std::unique_lock<std::mutex> >(s.mutex, "DigestIndex shard");
+	auto it = s.ids.find(digest);
+
+	if (it == s.ids.end())
+		return false;
+	id = it->second;
+	return true;
+}
+
+void DigestIndex::insert(uint64_t digest, uint32_t id) {
+	t_shard &s = shard(digest);
+	auto lock = traceLock<std::unique_lock<std::mutex> >(s.mutex, "DigestIndex shard");
+
+	// Overwrite: a payload that was linked to a cover whose save failed gets its new id
+	s.ids[digest] = id;
+}
+
+void DigestIndex::erase(uint64_t digest) {
+	t_shard &s = shard(digest);
+	auto lock = traceLock<std::unique_lock<std::mutex> >(s.mutex, "DigestIndex shard");
+
+	s.ids.erase(digest);
+}
+
+DigestIndex::t_shard &DigestIndex::shard(uint64_t digest) {
+	// The low bits feed the unordered_map buckets, pick the shard from the top ones
+	return _shards[digest >> 58];
+}
+
+const DigestIndex::t_shard &DigestIndex::shard(uint64_t digest) const {
+	return _shards[digest >> 58];
+}
@@ -1,18 +1,36 @@
 #include "Database.hpp"
-#include <iostream>
+#include "Log.hpp"
 
-Database::Database(const std::string &filename)
-	: _path(filename) {}
+Database::Database(const std::string &filename, const DbConfig &config)
+	: _path(filename), _config(config) {}
 
 Database::~Database() {
 	close();
 }
 
 bool Database::open() {
-	return sqlite3_open(_path.c_str(), &_db) == SQLITE_OK;
+	if (sqlite3_open(_path.c_str(), &_db) != SQLITE_OK) {
+		logError("Failed to open " + _path + ": " + sqlite3_errmsg(_db));
+		close();
+		return false;
+	}
+	return applyConfig();
+}
+
+bool Database::applyConfig() {
+	sqlite3_busy_timeout(_db, _config.busyTimeout);
+	// page_size must be set before journal_mode: WAL freezes it
+	return execute("PRAGMA page_size=" + std::to_string(_config.pageSize) + ";")
+		&& execute("PRAGMA journal_mode=" + _config.journalMode + ";")
+		&& execute("PRAGMA synchronous=" + std::string(_config.bulkLoad ? "OFF" : _config.synchronous) + ";")
+		&& execute("PRAGMA mmap_size=" + std::to_string(_config.mmapSize) + ";")
+		&& execute("PRAGMA cache_size=" + std::to_string(_config.cacheSize) + ";");
 }
 
 void Database::close() {
+	for (auto &kv : _statements)
+		sqlite3_finalize(kv.second);
+	_statements.clear();
 	if (_db) sqlite3_close(_db);
 	_db = nullptr;
 }
@@ -20,7 +38,7 @@ void Database::close() {
 bool Database::execute(const std::string &sql) {
 	char *err = nullptr;
 	if (sqlite3_exec(_db, sql.c_str(), nullptr, nullptr, &err) != SQLITE_OK) {
-		std::cerr << "SQL error: " << err << std::endl;
+		logError(std::string("SQL error: ") + (err ? err : sqlite3_errmsg(_db)));
 		sqlite3_free(err);
 		return false;
 	}
@@ -32,10 +50,29 @@ std::optional<sqlite3_stmt*> Database::prepare(const std::string &sql) {
 	if (sqlite3_prepare_v2(_db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
 		return stmt;
 	}
-	std::cerr << "Failed to prepare: " << sql << std::endl;
+	logError("Failed to prepare: " + sql + ": " + sqlite3_errmsg(_db));
 	return std::nullopt;
 }
 
+/**
+ * Statements are prepared once per connection and reused; callers must hand
+ * them back with release() so they stop holding locks and bound pointers.
+ */
+std::optional<sqlite3_stmt*> Database::cached(const std::string &sql) {
+	auto it = _statements.find(sql);
+	if (it != _statements.end())
+		return it->second;
+	auto s = prepare(sql);
+	if (s)
+		_statements.emplace(sql, *s);
+	return s;
+}
+
+void Database::release(sqlite3_stmt *stmt) {
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
+
 bool Database::initSchema() {
 	const std::string songs_sql = R"(
 CREATE TABLE IF NOT EXISTS songs (
@@ -60,85 +97,192 @@ CREATE TABLE IF NOT EXISTS log_additions (
 	comment TEXT
 );
 )";
-	return execute(songs_sql) && execute(log_sql);
+	const std::string files_sql = R"(
+CREATE TABLE IF NOT EXISTS files (
+	path TEXT PRIMARY KEY,
+	id TEXT,
+	size INTEGER,
+	mtime INTEGER,
+	inode INTEGER
+);
+)";
+	const std::string covers_sql = R"(
+CREATE TABLE IF NOT EXISTS covers (
+	id INTEGER PRIMARY KEY,
+	hash INTEGER NOT NULL,
+	path TEXT NOT NULL
+);
+)";
+	if (!execute(songs_sql) || !execute(log_sql) || !execute(files_sql) || !execute(covers_sql))
+		return false;
+	// Bulk load into an empty database: no secondary index is maintained while rows
+	// stream in, see createIndexes(). An existing one is kept for the frontend's readers
+	if (_config.bulkLoad && !hasSongs())
+		return true;
+	return createIndexes();
 }
 
-bool Database::upsertSong(const SongRecord &song, bool &isNew) {
-	// Try update first
-	const std::string upd =
-		"UPDATE songs SET title=?, artist=?, album=?, cover=?, duration=?, tags=?, path=? WHERE id=?;";
-	if (auto s = prepare(upd)) {
-		sqlite3_bind_text(*s, 1, song.title.c_str(), -1, SQLITE_TRANSIENT);
-		sqlite3_bind_text(*s, 2, song.artist.c_str(), -1, SQLITE_TRANSIENT);
-		sqlite3_bind_text(*s, 3, song.album.c_str(), -1, SQLITE_TRANSIENT);
-		if (song.cover) sqlite3_bind_int(*s, 4, *song.cover);
-		else sqlite3_bind_null(*s, 4);
-		sqlite3_bind_double(*s, 5, song.duration);
-		sqlite3_bind_text(*s, 6, song.tags.c_str(), -1, SQLITE_TRANSIENT);
-		sqlite3_bind_text(*s, 7, song.path.c_str(), -1, SQLITE_TRANSIENT);
-		sqlite3_bind_text(*s, 8, song.id.c_str(), -1, SQLITE_TRANSIENT);
-		if (sqlite3_step(*s) == SQLITE_DONE && sqlite3_changes(_db) > 0) {
-			sqlite3_finalize(*s);
-			isNew = false;
-			return true;
-		}
-		sqlite3_finalize(*s);
+bool Database::hasSongs() {
+	bool found = false;
+	if (auto s = cached("SELECT EXISTS(SELECT 1 FROM songs);")) {
+		found = sqlite3_step(*s) == SQLITE_ROW && sqlite3_column_int(*s, 0) != 0;
+		release(*s);
 	}
-	// Insert
-	const std::string ins =
-		"INSERT INTO songs (id,title,artist,album,cover,duration,tags,path) VALUES(?,?,?,?,?,?,?,?);";
-	if (auto s2 = prepare(ins)) {
-		sqlite3_bind_text(*s2, 1, song.id.c_str(), -1, SQLITE_TRANSIENT);
-		sqlite3_bind_text(*s2, 2, song.title.c_str(), -1, SQLITE_TRANSIENT);
-		sqlite3_bind_text(*s2, 3, song.artist.c_str(), -1, SQLITE_TRANSIENT);
-		sqlite3_bind_text(*s2, 4, song.album.c_str(), -1, SQLITE_TRANSIENT);
-		if (song.cover) sqlite3_bind_int(*s2, 5, *song.cover);
-		else sqlite3_bind_null(*s2, 5);
-		sqlite3_bind_double(*s2, 6, song.duration);
-		sqlite3_bind_text(*s2, 7, song.tags.c_str(), -1, SQLITE_TRANSIENT);
-		sqlite3_bind_text(*s2, 8, song.path.c_str(), -1, SQLITE_TRANSIENT);
-		bool ok = sqlite3_step(*s2) == SQLITE_DONE;
-		sqlite3_finalize(*s2);
-		isNew = true;
-		return ok;
+	return found;
+}
+
+bool Database::createIndexes() {
+	return execute("CREATE INDEX IF NOT EXISTS songs_cover ON songs(cover);")
+		&& execute("PRAGMA optimize;");
+}
+
+bool Database::upsertSong(const SongRecord &song, bool &isNew) {
+	// Single native upsert; bound strings outlive the step, so no copies are needed
+	const std::string sql =
+		"INSERT INTO songs (id,title,artist,album,cover,duration,tags,path) VALUES(?,?,?,?,?,?,?,?) "
+		"ON CONFLICT(id) DO UPDATE SET title=excluded.title, artist=excluded.artist, album=excluded.album, "
+		"cover=excluded.cover, duration=excluded.duration, tags=excluded.tags, path=excluded.path "
+		"RETURNING rowid;";
+	auto s = cached(sql);
+	if (!s)
+		return false;
+
+	sqlite3_bind_text(*s, 1, song.id.c_str(), -1, SQLITE_STATIC);
+	sqlite3_bind_text(*s, 2, song.title.c_str(), -1, SQLITE_STATIC);
+	sqlite3_bind_text(*s, 3, song.artist.c_str(), -1, SQLITE_STATIC);
+	sqlite3_bind_text(*s, 4, song.album.c_str(), -1, SQLITE_STATIC);
+	if (song.cover) sqlite3_bind_int(*s, 5, *song.cover);
+	else sqlite3_bind_null(*s, 5);
+	sqlite3_bind_double(*s, 6, song.duration);
+	sqlite3_bind_text(*s, 7, song.tags.c_str(), -1, SQLITE_STATIC);
+	sqlite3_bind_text(*s, 8, song.path.c_str(), -1, SQLITE_STATIC);
+
+	// The update branch leaves last_insert_rowid untouched, so clearing it first
+	// tells both branches apart
+	sqlite3_set_last_insert_rowid(_db, 0);
+	bool ok = sqlite3_step(*s) == SQLITE_ROW;
+	if (ok) {
+		isNew = sqlite3_last_insert_rowid(_db) == sqlite3_column_int64(*s, 0);
+		ok = sqlite3_step(*s) == SQLITE_DONE;
 	}
-	return false;
+	release(*s);
+	return ok;
 }
 
-std::vector<SongRecord> Database::fetchSongsWithNullCover() {
-	std::vector<SongRecord> result;
-	const std::string sql = "SELECT id,title,artist,album,cover,duration,tags,path FROM songs WHERE cover IS NULL;";
-	if (auto s = prepare(sql)) {
-		while (sqlite3_step(*s) == SQLITE_ROW) {
-			SongRecord rec;
-			rec.id = reinterpret_cast<const char*>(sqlite3_column_text(*s, 0));
-			rec.title = reinterpret_cast<const char*>(sqlite3_column_text(*s, 1));
-			rec.artist = reinterpret_cast<const char*>(sqlite3_column_text(*s, 2));
-			rec.album = reinterpret_cast<const char*>(sqlite3_column_text(*s, 3));
-			if (sqlite3_column_type(*s, 4) != SQLITE_NULL)
-				rec.cover = sqlite3_column_int(*s, 4);
-			rec.duration = sqlite3_column_double(*s, 5);
-			rec.tags = reinterpret_cast<const char*>(sqlite3_column_text(*s, 6));
-			rec.path = reinterpret_cast<const char*>(sqlite3_column_text(*s, 7));
-			result.push_back(std::move(rec));
-		}
-		sqlite3_finalize(*s);
+std::vector<std::string> Database::fetchPathsWithNullCover() {
+	std::vector<std::string> result;
+	// Rows written by other clients may leave any column NULL, path included
+	const std::string sql = "SELECT path FROM songs WHERE cover IS NULL AND path IS NOT NULL;";
+	if (auto s = cached(sql)) {
+		while (sqlite3_step(*s) == SQLITE_ROW)
+			result.emplace_back(reinterpret_cast<const char*>(sqlite3_column_text(*s, 0)));
+		release(*s);
 	}
 	return result;
 }
 
-bool Database::insertLogAddition(const LogAddition &log) {
+bool Database::insertLogAddition(LogAddition &log) {
 	const std::string ins =
 		"INSERT INTO log_additions (year,month,day,first_id,last_id,comment) VALUES(?,?,?,?,?,?);";
-	if (auto s = prepare(ins)) {
+	if (auto s = cached(ins)) {
 		sqlite3_bind_int(*s, 1, log.year);
 		sqlite3_bind_int(*s, 2, log.month);
 		sqlite3_bind_int(*s, 3, log.day);
 		sqlite3_bind_int(*s, 4, log.first_id);
 		sqlite3_bind_int(*s, 5, log.last_id);
-		sqlite3_bind_text(*s, 6, log.comment.c_str(), -1, SQLITE_TRANSIENT);
+		sqlite3_bind_text(*s, 6, log.comment.c_str(), -1, SQLITE_STATIC);
+		bool ok = sqlite3_step(*s) == SQLITE_DONE;
+		if (ok)
+			log.id = static_cast<int>(sqlite3_last_insert_rowid(_db));
+		release(*s);
+		return ok;
+	}
+	return false;
+}
+
+bool Database::updateLogAddition(const LogAddition &log) {
+	const std::string upd = "UPDATE log_additions SET last_id=?, comment=? WHERE id=?;";
+	if (auto s = cached(upd)) {
+		sqlite3_bind_int(*s, 1, log.last_id);
+		sqlite3_bind_text(*s, 2, log.comment.c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_int(*s, 3, log.id);
+		bool ok = sqlite3_step(*s) == SQLITE_DONE && sqlite3_changes(_db) == 1;
+		release(*s);
+		return ok;
+	}
+	return false;
+}
+
+std::vector<CoverRecord> Database::fetchCovers() {
+	std::vector<CoverRecord> result;
+	const std::string sql = "SELECT id,hash,path FROM covers ORDER BY id;";
+	if (auto s = cached(sql)) {
+		while (sqlite3_step(*s) == SQLITE_ROW) {
+			CoverRecord cover;
+			cover.id = sqlite3_column_int(*s, 0);
+			cover.hash = static_cast<uint64_t>(sqlite3_column_int64(*s, 1));
+			cover.path = reinterpret_cast<const char*>(sqlite3_column_text(*s, 2));
+			result.push_back(std::move(cover));
+		}
+		release(*s);
+	}
+	return result;
+}
+
+bool Database::insertCover(const CoverRecord &cover) {
+	const std::string ins = "INSERT OR REPLACE INTO covers (id,hash,path) VALUES(?,?,?);";
+	if (auto s = cached(ins)) {
+		sqlite3_bind_int(*s, 1, cover.id);
+		sqlite3_bind_int64(*s, 2, static_cast<sqlite3_int64>(cover.hash));
+		sqlite3_bind_text(*s, 3, cover.path.c_str(), -1, SQLITE_STATIC);
 		bool ok = sqlite3_step(*s) == SQLITE_DONE;
-		sqlite3_finalize(*s);
+		release(*s);
+		return ok;
+	}
+	return false;
+}
+
+bool Database::clearCover(int id) {
+	const std::string upd = "UPDATE songs SET cover=NULL WHERE cover=?;";
+	if (auto s = cached(upd)) {
+		sqlite3_bind_int(*s, 1, id);
+		bool ok = sqlite3_step(*s) == SQLITE_DONE;
+		release(*s);
+		return ok;
+	}
+	return false;
+}
+
+std::vector<FileState> Database::fetchFileStates() {
+	std::vector<FileState> result;
+	const std::string sql = "SELECT path,id,size,mtime,inode FROM files;";
+	if (auto s = cached(sql)) {
+		while (sqlite3_step(*s) == SQLITE_ROW) {
+			FileState state;
+			state.path = reinterpret_cast<const char*>(sqlite3_column_text(*s, 0));
+			if (sqlite3_column_type(*s, 1) != SQLITE_NULL)
+				state.id = reinterpret_cast<const char*>(sqlite3_column_text(*s, 1));
+			state.size = sqlite3_column_int64(*s, 2);
+			state.mtime = sqlite3_column_int64(*s, 3);
+			state.inode = sqlite3_column_int64(*s, 4);
+			result.push_back(std::move(state));
+		}
+		release(*s);
+	}
+	return result;
+}
+
+bool Database::upsertFileState(const FileState &state) {
+	const std::string ins =
+		"INSERT OR REPLACE INTO files (path,id,size,mtime,inode) VALUES(?,?,?,?,?);";
+	if (auto s = cached(ins)) {
+		sqlite3_bind_text(*s, 1, state.path.c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_text(*s, 2, state.id.c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_int64(*s, 3, state.size);
+		sqlite3_bind_int64(*s, 4, state.mtime);
+		sqlite3_bind_int64(*s, 5, state.inode);
+		bool ok = sqlite3_step(*s) == SQLITE_DONE;
+		release(*s);
 		return ok;
 	}
 	return false;
@@ -152,15 +296,41 @@ bool Database::commitTransaction() {
 	return execute("COMMIT;");
 }
 
+bool Database::rollbackTransaction() {
+	return execute("ROLLBACK;");
+}
+
 unsigned int Database::getLastSongId() {
-	const std::string sql = "SELECT MAX(CAST(id AS INTEGER)) FROM songs;";
-	if (auto s = prepare(sql)) {
+	// Ids recorded in files or reserved in log_additions are taken too, even without a song row
+	const std::string sql =
+		"SELECT MAX(v) FROM ("
+		"SELECT MAX(CAST(id AS INTEGER)) AS v FROM songs "
+		"UNION ALL SELECT MAX(CAST(id AS INTEGER)) FROM files "
+		"UNION ALL SELECT MAX(last_id) FROM log_additions);";
+	if (auto s = cached(sql)) {
+		if (sqlite3_step(*s) == SQLITE_ROW) {
+			int lastId = sqlite3_column_int(*s, 0);
+			release(*s);
+			return static_cast<unsigned int>(lastId);
+		}
+		release(*s);
+	}
+	return 0;
+}
+
+unsigned int Database::getLastCoverId() {
+	// Songs may link to a cover whose row was not committed yet when a run stopped
+	const std::string sql =
+		"SELECT MAX(v) FROM ("
+		"SELECT MAX(id) AS v FROM covers "
+		"UNION ALL SELECT MAX(cover) FROM songs);";
+	if (auto s = cached(sql)) {
 		if (sqlite3_step(*s) == SQLITE_ROW) {
 			int lastId = sqlite3_column_int(*s, 0);
-			sqlite3_finalize(*s);
+			release(*s);
 			return static_cast<unsigned int>(lastId);
 		}
-		sqlite3_finalize(*s);
+		release(*s);
 	}
 	return 0;
 }
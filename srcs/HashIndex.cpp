@@ -0,0 +1,109 @@
+#include "HashIndex.hpp"
+#include "Log.hpp"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+static const char		INDEX_MAGIC[4] = {'T', 'T', 'H', 'I'};
+static const uint32_t	INDEX_VERSION = 3; // 3: coverHash() thumbnails made as PHash makes them
+
+HashIndex::HashIndex(const std::string &filename)
+	: _path(filename) {}
+
+/**
+ * @brief Read a POD value from buf at pos, advancing pos. Fails on truncation.
+ */
+template<typename T>
+static bool readValue(const std::string &buf, size_t &pos, T &out) {
+	if (buf.size() - pos < sizeof(T))
+		return false;
+	std::memcpy(&out, buf.data() + pos, sizeof(T));
+	pos += sizeof(T);
+	return true;
+}
+
+template<typename T>
+static void writeValue(std::string &buf, const T &value) {
+	buf.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+bool HashIndex::load() {
+	std::ifstream in(_path, std::ios::binary | std::ios::ate);
+	if (!in.is_open())
+		return false;
+
+	std::string buf(static_cast<size_t>(in.tellg()), '\0');
+	in.seekg(0);
+	if (!in.read(&buf[0], buf.size()))
+		return false;
+
+	size_t		pos = 0;
+	char		magic[4];
+	uint32_t	version;
+	uint64_t	count;
+	if (!readValue(buf, pos, magic) || std::memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0
+		|| !readValue(buf, pos, version) || version != INDEX_VERSION
+		|| !readValue(buf, pos, count)) {
+		logError("Ignoring invalid hash index: " + _path);
+		return false;
+	}
+
+	_loaded.reserve(count);
+	for (uint64_t i = 0; i < count; ++i) {
+		t_hashEntry	entry;
+		uint32_t	nameLen;
+		if (!readValue(buf, pos, entry.size) || !readValue(buf, pos, entry.mtime)
+			|| !readValue(buf, pos, entry.hash) || !readValue(buf, pos, nameLen)
+			|| buf.size() - pos < nameLen) {
+			logError("Truncated hash index: " + _path);
+			break;
+		}
+		_loaded.emplace(buf.substr(pos, nameLen), entry);
+		pos += nameLen;
+	}
+	return true;
+}
+
+bool HashIndex::save() const {
+	std::string buf;
+	writeValue(buf, INDEX_MAGIC);
+	writeValue(buf, INDEX_VERSION);
+	writeValue(buf, static_cast<uint64_t>(_current.size()));
+	for (const auto &kv : _current) {
+		writeValue(buf, kv.second.size);
+		writeValue(buf, kv.second.mtime);
+		writeValue(buf, kv.second.hash);
+		writeValue(buf, static_cast<uint32_t>(kv.first.size()));
+		buf.append(kv.first);
+	}
+
+	// Write next to the index and rename so a crash never leaves a partial file
+	const std::string tmp = _path + ".tmp";
+	{
+		std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+		if (!out.write(buf.data(), buf.size())) {
+			logError("Failed to write hash index: " + tmp);
+			return false;
+		}
+	}
+	if (std::rename(tmp.c_str(), _path.c_str()) != 0) {
+		logError("Failed to replace hash index: " + _path);
+		return false;
+	}
+	return true;
+}
+
+const t_hashEntry *HashIndex::lookup(const std::string &name, uint64_t size, int64_t mtime) const {
+	auto it = _loaded.find(name);
+	if (it == _loaded.end() || it->second.size != size || it->second.mtime != mtime)
+		return nullptr;
+	return &it->second;
+}
+
+void HashIndex::update(const std::string &name, const t_hashEntry &entry) {
+	_current[name] = entry;
+}
+
+size_t HashIndex::loadedCount() const {
+	return _loaded.size();
+}
@@ -0,0 +1,344 @@
+#include "HashStore.hpp"
+#include "Trace.hpp"
+#include <cmath>
+#include <mutex>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define HASHSTORE_X86 1
+#endif
+
+typedef size_t (*t_hammingKernel)(const uint64_t *, size_t, uint64_t, unsigned int);
+
+static size_t	hammingScalar(const uint64_t *hashes, size_t count, uint64_t query, unsigned int threshold)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (static_cast<unsigned int>(__builtin_popcountll(hashes[i] ^ query)) < threshold)
+			return i;
+	}
+	return count;
+}
+
+#ifdef HASHSTORE_X86
+
+__attribute__((target("avx2")))
+static inline __m256i	popcount256(__m256i v)
+{
+	const __m256i	lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+										0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i	lowMask = _mm256_set1_epi8(0x0f);
+	__m256i			lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, lowMask));
+	__m256i			hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), lowMask));
+
+	return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+/**
+ * @brief AVX2 kernel: popcount each 64-bit lane with a nibble lookup table,
+ * then horizontally sum the bytes of each lane with SAD. 16 hashes per iteration.
+ */
+__attribute__((target("avx2")))
+static size_t	hammingAvx2(const uint64_t *hashes, size_t count, uint64_t query, unsigned int threshold)
+{
+	const __m256i	q = _mm256_set1_epi64x(static_cast<long long>(query));
+	const __m256i	limit = _mm256_set1_epi64x(threshold);
+	size_t			i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		__m256i	m0 = _mm256_cmpgt_epi64(limit, popcount256(_mm256_xor_si256(q,
+					_mm256_loadu_si256(reinterpret_cast<const __m256i *>(hashes + i)))));
+		__m256i	m1 = _mm256_cmpgt_epi64(limit, popcount256(_mm256_xor_si256(q,
+					_mm256_loadu_si256(reinterpret_cast<const __m256i *>(hashes + i + 4)))));
+		__m256i	m2 = _mm256_cmpgt_epi64(limit, popcount256(_mm256_xor_si256(q,
+					_mm256_loadu_si256(reinterpret_cast<const __m256i *>(hashes + i + 8)))));
+		__m256i	m3 = _mm256_cmpgt_epi64(limit, popcount256(_mm256_xor_si256(q,
+					_mm256_loadu_si256(reinterpret_cast<const __m256i *>(hashes + i + 12)))));
+		__m256i	any = _mm256_or_si256(_mm256_or_si256(m0, m1), _mm256_or_si256(m2, m3));
+		if (!_mm256_testz_si256(any, any))
+			return i + hammingScalar(hashes + i, 16, query, threshold);
+	}
+	return i + hammingScalar(hashes + i, count - i, query, threshold);
+}
+
+/**
+ * @brief AVX-512 kernel using the native 64-bit lane popcount. 32 hashes per iteration.
+ */
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static size_t	hammingAvx512(const uint64_t *hashes, size_t count, uint64_t query, unsigned int threshold)
+{
+	const __m512i	q = _mm512_set1_epi64(static_cast<long long>(query));
+	const __m512i	limit = _mm512_set1_epi64(threshold);
+	size_t			i = 0;
+
+	for (; i + 32 <= count; i += 32)
+	{
+		__mmask8	m0 = _mm512_cmplt_epu64_mask(_mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_loadu_si512(hashes + i))), limit);
+		__mmask8	m1 = _mm512_cmplt_epu64_mask(_mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_loadu_si512(hashes + i + 8))), limit);
+		__mmask8	m2 = _mm512_cmplt_epu64_mask(_mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_loadu_si512(hashes + i + 16))), limit);
+		__mmask8	m3 = _mm512_cmplt_epu64_mask(_mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_loadu_si512(hashes + i + 24))), limit);
+		if (m0 | m1 | m2 | m3)
+			return i + hammingScalar(hashes + i, 32, query, threshold);
+	}
+	return i + hammingScalar(hashes + i, count - i, query, threshold);
+}
+
+#endif
+
+static t_hammingKernel	selectKernel()
+{
+#ifdef HASHSTORE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"))
+		return hammingAvx512;
+	if (__builtin_cpu_supports("avx2"))
+		return hammingAvx2;
+#endif
+	return hammingScalar;
+}
+
+size_t	hammingFindFirst(const uint64_t *hashes, size_t count, uint64_t query, unsigned int threshold)
+{
+	static const t_hammingKernel	kernel = selectKernel();
+
+	return kernel(hashes, count, query, threshold);
+}
+
+static const unsigned int	PHASH_COEFFS = 8;
+
+static_assert(PHASH_THUMB_SIZE == 32 && PHASH_COEFFS == 8, "dctLow() butterflies are written for 32 -> 8");
+
+typedef struct s_dctBasis
+{
+	double	cosines[PHASH_COEFFS][PHASH_THUMB_SIZE / 2];
+
+	s_dctBasis() {
+		// Orthonormal DCT-II basis, as cv::dct scales it. Only the first half of
+		// each row is kept: the other half mirrors it, up to the sign
+		const double	pi = 3.14159265358979323846;
+		const double	n = PHASH_THUMB_SIZE;
+
+		for (unsigned int k = 0; k < PHASH_COEFFS; ++k) {
+			const double	scale = std::sqrt((k == 0 ? 1.0 : 2.0) / n);
+			for (unsigned int x = 0; x < PHASH_THUMB_SIZE / 2; ++x)
+				cosines[k][x] = scale * std::cos(pi * (2 * x + 1) * k / (2 * n));
+		}
+	}
+}	t_dctBasis;
+
+/**
+ * @brief First PHASH_COEFFS DCT-II coefficients of 32 samples, stored as float
+ *
+ * Even/odd butterflies fold the input before multiplying, as the fast DCT of
+ * cv::dct does, so symmetric inputs give exact zeros where it does: a flat
+ * thumbnail must hash to 0, not to the signs of rounding noise.
+ */
+static void	dctLow(const t_dctBasis &basis, const double *in, float *out)
+{
+	double	even[16], odd[16], even2[8], odd2[8], even3[4], odd3[4];
+
+	for (unsigned int x = 0; x < 16; ++x) {
+		even[x] = in[x] + in[31 - x];
+		odd[x] = in[x] - in[31 - x];
+	}
+	for (unsigned int x = 0; x < 8; ++x) {
+		even2[x] = even[x] + even[15 - x];
+		odd2[x] = even[x] - even[15 - x];
+	}
+	for (unsigned int x = 0; x < 4; ++x) {
+		even3[x] = even2[x] + even2[7 - x];
+		odd3[x] = even2[x] - even2[7 - x];
+	}
+
+	for (unsigned int k = 0; k < PHASH_COEFFS; ++k) {
+		// Odd k: 16 differences, k = 2 or 6: 8, k = 4: 4, k = 0: 4 sums
+		const double		*folded = (k & 1) ? odd : (k & 2) ? odd2 : k ? odd3 : even3;
+		const unsigned int	len = (k & 1) ? 16 : (k & 2) ? 8 : 4;
+		double				acc = 0.0;
+
+		for (unsigned int x = 0; x < len; ++x)
+			acc += basis.cosines[k][x] * folded[x];
+		out[k] = static_cast<float>(acc);
+	}
+}
+
+uint64_t	perceptualHash(const uint8_t *pixels, size_t stride)
+{
+	static const t_dctBasis	basis;
+	double					line[PHASH_THUMB_SIZE];
+	float					rows[PHASH_THUMB_SIZE][PHASH_COEFFS];
+	float					coeffs[PHASH_COEFFS][PHASH_COEFFS];
+	double					sum = 0.0;
+	uint64_t				hash = 0;
+
+	// Separable transform like cv::dct on a CV_32F matrix: every row, then every
+	// column, each pass stored as float
+	for (unsigned int y = 0; y < PHASH_THUMB_SIZE; ++y) {
+		const uint8_t	*row = pixels + y * stride;
+		for (unsigned int x = 0; x < PHASH_THUMB_SIZE; ++x)
+			line[x] = row[x];
+		dctLow(basis, line, rows[y]);
+	}
+	for (unsigned int u = 0; u < PHASH_COEFFS; ++u) {
+		float	column[PHASH_COEFFS];
+		for (unsigned int y = 0; y < PHASH_THUMB_SIZE; ++y)
+			line[y] = rows[y][u];
+		dctLow(basis, line, column);
+		for (unsigned int v = 0; v < PHASH_COEFFS; ++v)
+			coeffs[v][u] = column[v];
+	}
+
+	// DC zeroed, then each coefficient compared with the mean, as PHash does
+	coeffs[0][0] = 0.0f;
+	for (unsigned int v = 0; v < PHASH_COEFFS; ++v) {
+		for (unsigned int u = 0; u < PHASH_COEFFS; ++u)
+			sum += coeffs[v][u];
+	}
+	const float mean = static_cast<float>(sum / (PHASH_COEFFS * PHASH_COEFFS));
+	for (unsigned int v = 0; v < PHASH_COEFFS; ++v) {
+		for (unsigned int u = 0; u < PHASH_COEFFS; ++u) {
+			if (coeffs[v][u] > mean)
+				hash |= 1ULL << (v * PHASH_COEFFS + u);
+		}
+	}
+	return hash;
+}
+
+HashStore::HashStore(unsigned int threshold)
+	: _threshold(threshold) {
+	// Per-chunk search radius guaranteed by the pigeonhole principle
+	const unsigned int radius = threshold ? (threshold - 1) / CHUNKS : 0;
+
+	for (uint32_t mask = 0; mask < (1u << CHUNK_BITS); ++mask) {
+		if (static_cast<unsigned int>(__builtin_popcount(mask)) <= radius)
+			_probes.push_back(static_cast<uint16_t>(mask));
+	}
+	for (unsigned int c = 0; c < CHUNKS; ++c)
+		_tables[c].resize(1u << CHUNK_BITS);
+}
+
+void HashStore::reserve(size_t n) {
+	std::unique_lock<std::shared_mutex> lock(_mutex);
+	_hashes.reserve(n);
+	_ids.reserve(n);
+}
+
+void HashStore::push(uint64_t hash, uint32_t id) {
+	std::unique_lock<std::shared_mutex> lock(_mutex);
+	pushLocked(hash, id);
+	if (id >= _nextId)
+		_nextId = id + 1;
+}
+
+void HashStore::skipIds(uint32_t last) {
+	std::unique_lock<std::shared_mutex> lock(_mutex);
+	if (last >= _nextId)
+		_nextId = last + 1;
+}
+
+bool HashStore::insertUnique(uint64_t hash, uint32_t &id) {
+	size_t seen, erasures;
+	{
+		auto lock = traceLock<std::shared_lock<std::shared_mutex> >(_mutex, "HashStore (shared)");
+		long match = findNearLocked(hash);
+		if (match >= 0) {
+			id = static_cast<uint32_t>(match);
+			return false;
+		}
+		seen = _hashes.size();
+		erasures = _erasures;
+	}
+
+	auto lock = traceLock<std::unique_lock<std::shared_mutex> >(_mutex, "HashStore (exclusive)");
+	if (erasures != _erasures) {
+		// An erase moved hashes around: the tail is no longer meaningful
+		long match = findNearLocked(hash);
+		if (match >= 0) {
+			id = static_cast<uint32_t>(match);
+			return false;
+		}
+	}
+	else {
+		// Only hashes inserted while the lock was released still need checking
+		size_t tail = hammingFindFirst(_hashes.data() + seen, _hashes.size() - seen, hash, _threshold);
+		if (seen + tail < _hashes.size()) {
+			id = _ids[seen + tail];
+			return false;
+		}
+	}
+	id = _nextId++;
+	pushLocked(hash, id);
+	return true;
+}
+
+void HashStore::erase(uint64_t hash, uint32_t id) {
+	auto lock = traceLock<std::unique_lock<std::shared_mutex> >(_mutex, "HashStore (exclusive)");
+	size_t index = _hashes.size();
+
+	for (const t_slot &slot : bucket(0, hash)) {
+		if (slot.hash == hash && _ids[slot.index] == id) {
+			index = slot.index;
+			break;
+		}
+	}
+	if (index == _hashes.size())
+		return;
+
+	// Swap-remove: the last hash takes the freed position
+	const size_t last = _hashes.size() - 1;
+	const uint64_t moved = _hashes[last];
+	for (unsigned int c = 0; c < CHUNKS; ++c) {
+		std::vector<t_slot> &b = bucket(c, hash);
+		for (size_t i = 0; i < b.size(); ++i) {
+			if (b[i].index == index) {
+				b.erase(b.begin() + i);
+				break;
+			}
+		}
+		for (t_slot &slot : bucket(c, moved)) {
+			if (slot.index == last)
+				slot.index = static_cast<uint32_t>(index);
+		}
+	}
+	_hashes[index] = moved;
+	_ids[index] = _ids[last];
+	_hashes.pop_back();
+	_ids.pop_back();
+	++_erasures;
+}
+
+long HashStore::findNearLocked(uint64_t hash) const {
+	long best = -1;
+
+	if (_hashes.size() <= LINEAR_SCAN_MAX) {
+		size_t i = hammingFindFirst(_hashes.data(), _hashes.size(), hash, _threshold);
+		return i == _hashes.size() ? best : static_cast<long>(_ids[i]);
+	}
+	if (_threshold == 0)
+		return best;
+	for (unsigned int c = 0; c < CHUNKS; ++c) {
+		const uint16_t key = static_cast<uint16_t>(hash >> (c * CHUNK_BITS));
+		for (uint16_t probe : _probes) {
+			for (const t_slot &slot : _tables[c][key ^ probe]) {
+				if ((best < 0 || slot.index < best)
+					&& static_cast<unsigned int>(__builtin_popcountll(slot.hash ^ hash)) < _threshold)
+					best = slot.index;
+			}
+		}
+	}
+	return best < 0 ? best : static_cast<long>(_ids[best]);
+}
+
+void HashStore::pushLocked(uint64_t hash, uint32_t id) {
+	const uint32_t index = static_cast<uint32_t>(_hashes.size());
+
+	_hashes.push_back(hash);
+	_ids.push_back(id);
+	for (unsigned int c = 0; c < CHUNKS; ++c)
+		bucket(c, hash).push_back({hash, index});
+}
+
+std::vector<HashStore::t_slot> &HashStore::bucket(unsigned int chunk, uint64_t hash) {
+	return _tables[chunk][static_cast<uint16_t>(hash >> (chunk * CHUNK_BITS))];
+}
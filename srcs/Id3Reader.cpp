@@ -0,0 +1,335 @@
+#include "Id3Reader.hpp"
+#include <cstdint>
+
+static const size_t	HEADER_SIZE = 10;
+static const size_t	MPEG_SCAN_MAX = 64 * 1024; // Junk tolerated between the tag and the first frame
+
+static inline uint32_t	readBe32(const uint8_t *p)
+{
+	return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16)
+		| (static_cast<uint32_t>(p[2]) << 8) | p[3];
+}
+
+static inline uint32_t	readSyncsafe(const uint8_t *p)
+{
+	return (static_cast<uint32_t>(p[0] & 0x7f) << 21) | (static_cast<uint32_t>(p[1] & 0x7f) << 14)
+		| (static_cast<uint32_t>(p[2] & 0x7f) << 7) | (p[3] & 0x7f);
+}
+
+/**
+ * @brief Bytes of the string terminator for a text encoding
+ */
+static inline size_t	terminatorSize(uint8_t encoding)
+{
+	return encoding == 1 || encoding == 2 ? 2 : 1;
+}
+
+/**
+ * @brief Offset just past the terminated string starting at pos, or npos
+ */
+static size_t	skipTerminated(std::string_view payload, size_t pos, uint8_t encoding)
+{
+	if (terminatorSize(encoding) == 1)
+	{
+		size_t end = payload.find('\0', pos);
+		return end == std::string_view::npos ? end : end + 1;
+	}
+	for (; pos + 1 < payload.size(); pos += 2)
+	{
+		if (payload[pos] == '\0' && payload[pos + 1] == '\0')
+			return pos + 2;
+	}
+	return std::string_view::npos;
+}
+
+/**
+ * @brief Keep a TXXX frame if it is the 42id one
+ */
+static void	readUserText(std::string_view payload, t_id3Tag &tag)
+{
+	if (tag.has42id || payload.empty())
+		return;
+
+	const uint8_t	encoding = static_cast<uint8_t>(payload[0]);
+	const size_t	valueStart = skipTerminated(payload, 1, encoding);
+
+	if (valueStart == std::string_view::npos || id3Text(payload.substr(0, valueStart)) != "42id")
+		return;
+	tag.id42 = payload.substr(valueStart);
+	tag.id42Encoding = encoding;
+	tag.has42id = true;
+}
+
+/**
+ * @brief Keep the image data of the first APIC frame
+ */
+static bool	readPicture(std::string_view payload, t_id3Tag &tag)
+{
+	if (!tag.picture.empty() || payload.empty())
+		return true;
+
+	const uint8_t	encoding = static_cast<uint8_t>(payload[0]);
+	size_t			pos = skipTerminated(payload, 1, 0); // MIME type is always Latin-1
+
+	if (pos == std::string_view::npos || pos >= payload.size())
+		return false;
+	pos = skipTerminated(payload, pos + 1, encoding); // Picture type, then description
+	if (pos == std::string_view::npos)
+		return false;
+	tag.picture = payload.substr(pos);
+	return true;
+}
+
+bool	readId3v2(const char *data, size_t size, t_id3Tag &tag)
+{
+	const uint8_t	*bytes = reinterpret_cast<const uint8_t *>(data);
+
+	tag = t_id3Tag();
+	if (size < HEADER_SIZE || bytes[0] != 'I' || bytes[1] != 'D' || bytes[2] != '3')
+		return false;
+
+	const uint8_t	version = bytes[3];
+	const uint8_t	flags = bytes[5];
+	const size_t	tagSize = readSyncsafe(bytes + 6);
+
+	// Tag-wide unsynchronisation rewrites frame bytes: leave it to TagLib
+	if ((version != 3 && version != 4) || (flags & 0x80) || HEADER_SIZE + tagSize > size)
+		return false;
+
+	size_t			pos = HEADER_SIZE;
+	const size_t	end = HEADER_SIZE + tagSize;
+
+	tag.audioStart = end + ((version == 4 && (flags & 0x10)) ? HEADER_SIZE : 0);
+	if (flags & 0x40)
+	{
+		if (pos + 4 > end)
+			return false;
+		// v2.3 extended header size excludes its own size field, v2.4 includes it
+		pos += version == 3 ? readBe32(bytes + pos) + 4 : readSyncsafe(bytes + pos);
+	}
+
+	while (pos + HEADER_SIZE <= end && bytes[pos] != 0) // Padding starts with a zero byte
+	{
+		const std::string_view	id(data + pos, 4);
+		const size_t			frameSize = version == 4 ? readSyncsafe(bytes + pos + 4) : readBe32(bytes + pos + 4);
+		const uint8_t			format = bytes[pos + 9];
+
+		pos += HEADER_SIZE;
+		if (frameSize > end - pos)
+			return false;
+		// v2.4: grouping, compression, encryption, unsync, length indicator; v2.3: compression, encryption, grouping
+		if (version == 4 ? (format & 0x4f) : (format & 0xe0))
+			return false;
+
+		const std::string_view	payload(data + pos, frameSize);
+		if (id == "TIT2" && tag.title.empty())
+			tag.title = payload;
+		else if (id == "TPE1" && tag.artist.empty())
+			tag.artist = payload;
+		else if (id == "TALB" && tag.album.empty())
+			tag.album = payload;
+		else if (id == "TCON" && tag.genre.empty())
+		{
+			// v2.3 "(17)" style references are translated by TagLib
+			if (payload.size() > 1 && payload[1] == '(')
+				return false;
+			tag.genre = payload;
+		}
+		else if (id == "TXXX")
+			readUserText(payload, tag);
+		else if (id == "APIC" && !readPicture(payload, tag))
+			return false;
+		pos += frameSize;
+	}
+	return true;
+}
+
+static void	appendUtf8(std::string &out, uint32_t cp)
+{
+	if (cp < 0x80)
+		out += static_cast<char>(cp);
+	else if (cp < 0x800)
+	{
+		out += static_cast<char>(0xc0 | (cp >> 6));
+		out += static_cast<char>(0x80 | (cp & 0x3f));
+	}
+	else if (cp < 0x10000)
+	{
+		out += static_cast<char>(0xe0 | (cp >> 12));
+		out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+		out += static_cast<char>(0x80 | (cp & 0x3f));
+	}
+	else
+	{
+		out += static_cast<char>(0xf0 | (cp >> 18));
+		out += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+		out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+		out += static_cast<char>(0x80 | (cp & 0x3f));
+	}
+}
+
+/**
+ * @brief Decode UTF-16 text; a BOM, when present, overrides big_endian
+ */
+static void	appendUtf16(std::string &out, std::string_view text, bool big_endian)
+{
+	const uint8_t	*p = reinterpret_cast<const uint8_t *>(text.data());
+	size_t			i = 0;
+	uint32_t		unit;
+	uint32_t		low;
+
+	if (text.size() >= 2 && ((p[0] == 0xff && p[1] == 0xfe) || (p[0] == 0xfe && p[1] == 0xff)))
+	{
+		big_endian = p[0] == 0xfe;
+		i = 2;
+	}
+	for (; i + 1 < text.size(); i += 2)
+	{
+		unit = big_endian ? (p[i] << 8) | p[i + 1] : (p[i + 1] << 8) | p[i];
+		if (unit >= 0xd800 && unit < 0xdc00 && i + 3 < text.size())
+		{
+			low = big_endian ? (p[i + 2] << 8) | p[i + 3] : (p[i + 3] << 8) | p[i + 2];
+			if (low >= 0xdc00 && low < 0xe000)
+			{
+				unit = 0x10000 + ((unit - 0xd800) << 10) + (low - 0xdc00);
+				i += 2;
+			}
+		}
+		appendUtf8(out, unit);
+	}
+}
+
+std::string	id3Text(uint8_t encoding, std::string_view text)
+{
+	std::string		out;
+	const size_t	unit = terminatorSize(encoding);
+	size_t			pos = 0;
+	size_t			next;
+
+	out.reserve(text.size());
+	while (pos < text.size())
+	{
+		next = skipTerminated(text, pos, encoding);
+		std::string_view value = text.substr(pos, next == std::string_view::npos ? std::string_view::npos : next - pos - unit);
+		if (!value.empty())
+		{
+			if (!out.empty())
+				out += ' ';
+			if (encoding == 0)
+			{
+				for (unsigned char c : value)
+					appendUtf8(out, c);
+			}
+			else if (encoding == 3)
+				out.append(value);
+			else
+				appendUtf16(out, value, encoding == 2);
+		}
+		if (next == std::string_view::npos)
+			break;
+		pos = next;
+	}
+	return out;
+}
+
+std::string	id3Text(std::string_view payload)
+{
+	if (payload.empty())
+		return std::string();
+	return id3Text(static_cast<uint8_t>(payload[0]), payload.substr(1));
+}
+
+typedef struct s_mpegHeader
+{
+	int		version;	// 1, 2 or 25 (MPEG 2.5)
+	int		layer;
+	int		bitrate;	// kbit/s
+	int		sampleRate;
+	bool	mono;
+	size_t	frameLength;
+	int		samples;	// Samples per frame
+}	t_mpegHeader;
+
+static bool	parseMpegHeader(const uint8_t *p, t_mpegHeader &h)
+{
+	static const int	bitrates[2][3][16] = {
+		{	// MPEG 1, layers I-III
+			{0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0},
+			{0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0},
+			{0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0}},
+		{	// MPEG 2 / 2.5, layers I-III
+			{0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0},
+			{0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},
+			{0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0}}};
+	static const int	sampleRates[3][3] = {{44100, 48000, 32000}, {22050, 24000, 16000}, {11025, 12000, 8000}};
+
+	if (p[0] != 0xff || (p[1] & 0xe0) != 0xe0)
+		return false;
+
+	const int	versionBits = (p[1] >> 3) & 0x03;
+	const int	layerBits = (p[1] >> 1) & 0x03;
+	const int	bitrateIndex = p[2] >> 4;
+	const int	rateIndex = (p[2] >> 2) & 0x03;
+
+	if (versionBits == 1 || layerBits == 0 || bitrateIndex == 0 || bitrateIndex == 15 || rateIndex == 3)
+		return false;
+	h.version = versionBits == 3 ? 1 : (versionBits == 2 ? 2 : 25);
+	h.layer = 4 - layerBits;
+	h.bitrate = bitrates[h.version == 1 ? 0 : 1][h.layer - 1][bitrateIndex];
+	h.sampleRate = sampleRates[h.version == 1 ? 0 : (h.version == 2 ? 1 : 2)][rateIndex];
+	h.mono = (p[3] >> 6) == 3;
+
+	const int	padding = (p[2] >> 1) & 0x01;
+	if (h.layer == 1)
+	{
+		h.samples = 384;
+		h.frameLength = (12 * h.bitrate * 1000 / h.sampleRate + padding) * 4;
+	}
+	else
+	{
+		h.samples = (h.layer == 3 && h.version != 1) ? 576 : 1152;
+		h.frameLength = h.samples / 8 * h.bitrate * 1000 / h.sampleRate + padding;
+	}
+	return h.frameLength > 4;
+}
+
+long	mpegLengthMs(const char *data, size_t size, size_t audio_start)
+{
+	const uint8_t	*bytes = reinterpret_cast<const uint8_t *>(data);
+	const size_t	scanEnd = audio_start + MPEG_SCAN_MAX < size ? audio_start + MPEG_SCAN_MAX : size;
+	t_mpegHeader	h;
+	t_mpegHeader	next;
+	size_t			pos = audio_start;
+
+	// First header followed by another valid one, to skip false syncs
+	for (; pos + 4 <= scanEnd; ++pos)
+	{
+		if (parseMpegHeader(bytes + pos, h)
+			&& (pos + h.frameLength + 4 > size || parseMpegHeader(bytes + pos + h.frameLength, next)))
+			break;
+	}
+	if (pos + 4 > scanEnd)
+		return -1;
+
+	// Xing/Info sits after the side information, VBRI at a fixed offset
+	const size_t	sideInfo = h.version == 1 ? (h.mono ? 17 : 32) : (h.mono ? 9 : 17);
+	const size_t	xing = pos + 4 + sideInfo;
+	const size_t	vbri = pos + 4 + 32;
+	uint32_t		frames = 0;
+
+	if (xing + 12 <= size && (std::string_view(data + xing, 4) == "Xing" || std::string_view(data + xing, 4) == "Info")
+		&& (bytes[xing + 7] & 0x01))
+		frames = readBe32(bytes + xing + 8);
+	else if (vbri + 18 <= size && std::string_view(data + vbri, 4) == "VBRI")
+		frames = readBe32(bytes + vbri + 14);
+	if (frames > 0)
+		return static_cast<long>(static_cast<double>(frames) * h.samples * 1000 / h.sampleRate + 0.5);
+
+	// Constant bitrate: the audio runs up to the ID3v1 tag, if any
+	size_t	streamEnd = size;
+	if (size >= 128 && std::string_view(data + size - 128, 3) == "TAG")
+		streamEnd -= 128;
+	if (streamEnd <= pos)
+		return -1;
+	return static_cast<long>(static_cast<double>(streamEnd - pos) * 8 / h.bitrate + 0.5);
+}
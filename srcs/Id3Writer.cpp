@@ -0,0 +1,185 @@
+#include "Id3Writer.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+static const size_t	HEADER_SIZE = 10;
+static const size_t	PADDING_RESERVE = 16 * 1024; // Room left for later frames when the tag must grow
+static const size_t	COPY_CHUNK = 1 << 20;
+static const size_t	SYNCSAFE_MAX = (1u << 28) - 1;
+
+static uint32_t	readSize(const uint8_t *p, bool syncsafe)
+{
+	if (syncsafe)
+		return (static_cast<uint32_t>(p[0] & 0x7f) << 21) | (static_cast<uint32_t>(p[1] & 0x7f) << 14)
+			| (static_cast<uint32_t>(p[2] & 0x7f) << 7) | (p[3] & 0x7f);
+	return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16)
+		| (static_cast<uint32_t>(p[2]) << 8) | p[3];
+}
+
+static void	writeSize(uint8_t *p, uint32_t size, bool syncsafe)
+{
+	const int	bits = syncsafe ? 7 : 8;
+	const int	mask = syncsafe ? 0x7f : 0xff;
+
+	for (int i = 3; i >= 0; --i, size >>= bits)
+		p[i] = static_cast<uint8_t>(size & mask);
+}
+
+static bool	readAll(int fd, void *buf, size_t size, off_t offset)
+{
+	uint8_t	*p = static_cast<uint8_t *>(buf);
+	ssize_t	n;
+
+	while (size > 0)
+	{
+		n = pread(fd, p, size, offset);
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= static_cast<size_t>(n);
+		offset += n;
+	}
+	return true;
+}
+
+static bool	writeAll(int fd, const void *buf, size_t size, off_t offset)
+{
+	const uint8_t	*p = static_cast<const uint8_t *>(buf);
+	ssize_t			n;
+
+	while (size > 0)
+	{
+		n = pwrite(fd, p, size, offset);
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= static_cast<size_t>(n);
+		offset += n;
+	}
+	return true;
+}
+
+/**
+ * @brief Offset of the first padding byte of a tag, or 0 if its frames are malformed
+ */
+static size_t	paddingStart(const std::vector<uint8_t> &tag, bool syncsafe)
+{
+	size_t	pos = HEADER_SIZE;
+	size_t	frameSize;
+
+	while (pos + HEADER_SIZE <= tag.size() && tag[pos] != 0)
+	{
+		frameSize = readSize(&tag[pos + 4], syncsafe);
+		if (frameSize > tag.size() - pos - HEADER_SIZE)
+			return 0;
+		pos += HEADER_SIZE + frameSize;
+	}
+	return pos < tag.size() ? pos : tag.size();
+}
+
+/**
+ * @brief Write the file with its tag rebuilt as head + frame + padding to a sibling temporary file, then swap it in
+ *
+ * The swap happens next to the real file, so a song reached through a symlink
+ * keeps its link. Hard-linked files are refused: a rename would detach the
+ * other names. Owner, group and mode are copied to the new file.
+ */
+static bool	rewriteWithPadding(int fd, const std::string &path, const std::vector<uint8_t> &tag,
+								size_t used, const std::vector<uint8_t> &frame, const struct stat &st)
+{
+	const size_t		newSize = used - HEADER_SIZE + frame.size() + PADDING_RESERVE;
+	std::vector<uint8_t>	head(tag.begin(), tag.begin() + used);
+	std::vector<uint8_t>	chunk;
+	off_t				in = static_cast<off_t>(tag.size());
+	off_t				out = 0;
+	bool				ok;
+
+	if (newSize > SYNCSAFE_MAX || st.st_nlink > 1)
+		return false;
+
+	char	*real = realpath(path.c_str(), nullptr);
+	if (!real)
+		return false;
+	const std::string	target(real);
+	const std::string	tmpPath = target + ".42tmp";
+	std::free(real);
+	writeSize(&head[6], static_cast<uint32_t>(newSize), true);
+	head.insert(head.end(), frame.begin(), frame.end());
+	head.resize(head.size() + PADDING_RESERVE, 0);
+
+	int	tmp = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (tmp < 0)
+		return false;
+	// chown first: it may clear set-id bits that fchmod then restores
+	ok = fchown(tmp, st.st_uid, st.st_gid) == 0 && fchmod(tmp, st.st_mode & 07777) == 0;
+	ok = ok && writeAll(tmp, head.data(), head.size(), out);
+	out += static_cast<off_t>(head.size());
+	chunk.resize(COPY_CHUNK);
+	while (ok && in < st.st_size)
+	{
+		const size_t	n = static_cast<size_t>(std::min<off_t>(st.st_size - in, COPY_CHUNK));
+		ok = readAll(fd, chunk.data(), n, in) && writeAll(tmp, chunk.data(), n, out);
+		in += static_cast<off_t>(n);
+		out += static_cast<off_t>(n);
+	}
+	ok = ok && fsync(tmp) == 0;
+	ok = close(tmp) == 0 && ok;
+	if (!ok || std::rename(tmpPath.c_str(), target.c_str()) != 0)
+	{
+		std::remove(tmpPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool	addId3UserText(const std::string &path, const std::string &description, const std::string &value)
+{
+	uint8_t		header[HEADER_SIZE];
+	struct stat	st;
+	bool		ok = false;
+	int			fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) != 0 || !readAll(fd, header, HEADER_SIZE, 0)
+		|| header[0] != 'I' || header[1] != 'D' || header[2] != '3' || (header[3] != 3 && header[3] != 4)
+		|| (header[5] & 0xd0)) // Unsynchronisation, extended header (may hold a CRC or padding size) or footer
+	{
+		close(fd);
+		return false;
+	}
+
+	const bool				v24 = header[3] == 4;
+	std::vector<uint8_t>	tag(HEADER_SIZE + readSize(header + 6, true));
+
+	if (static_cast<off_t>(tag.size()) <= st.st_size && readAll(fd, tag.data(), tag.size(), 0))
+	{
+		// UTF-8 only exists since v2.4; the description and ids are ASCII either way
+		std::vector<uint8_t>	frame(HEADER_SIZE);
+		frame.push_back(v24 ? 3 : 0);
+		frame.insert(frame.end(), description.begin(), description.end());
+		frame.push_back(0);
+		frame.insert(frame.end(), value.begin(), value.end());
+		frame[0] = 'T';
+		frame[1] = 'X';
+		frame[2] = 'X';
+		frame[3] = 'X';
+		writeSize(&frame[4], static_cast<uint32_t>(frame.size() - HEADER_SIZE), v24);
+
+		const size_t	used = paddingStart(tag, v24);
+		if (used == 0)
+			ok = false;
+		else if (tag.size() - used >= frame.size())
+			ok = writeAll(fd, frame.data(), frame.size(), static_cast<off_t>(used)); // Fits in the padding
+		else
+			ok = rewriteWithPadding(fd, path, tag, used, frame, st);
+	}
+	close(fd);
+	return ok;
+}
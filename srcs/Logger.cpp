@@ -0,0 +1,165 @@
+#include "Logger.hpp"
+#include "Trace.hpp"
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <unistd.h>
+
+Logger::Logger(std::ofstream &info, std::mutex &console_mutex)
+	: _info(info), _consoleMutex(console_mutex), _queue(LOG_QUEUE_SIZE) {}
+
+Logger::~Logger() {
+	stop();
+}
+
+void Logger::start() {
+	if (_started.exchange(true))
+		return;
+	_flusher = std::thread(&Logger::run, this);
+}
+
+void Logger::stop() {
+	if (!_flusher.joinable())
+		return;
+	// Writers from now on write synchronously
+	_started = false;
+	_queue.close();
+	_flusher.join();
+	// A writer that saw _started just before it was cleared may have queued after
+	// the flusher's last pop
+	drain();
+
+	size_t dropped = _dropped.exchange(0);
+	if (dropped)
+		write(INFO, std::to_string(dropped) + " log messages dropped: log queue full", false);
+}
+
+void Logger::write(t_stream stream, std::string message, bool console) {
+	t_entry entry;
+
+	entry.ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+	entry.stream = stream;
+	entry.console = console;
+	entry.text = std::move(message);
+
+	if (_started.load(std::memory_order_acquire)) {
+		bool queued = _queue.tryPush(entry);
+		// Plain info may be dropped; errors and console output wait for room
+		if (!queued && stream == INFO && !console) {
+			_dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		while (!queued && _started.load(std::memory_order_relaxed)) {
+			std::this_thread::yield();
+			queued = _queue.tryPush(entry);
+		}
+		if (queued) {
+			// Pairs with the fence in drain(): either stop() drains after our push,
+			// or we see it stopping and drain ourselves
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (!_started.load(std::memory_order_relaxed))
+				drain();
+			return;
+		}
+		// stop() began while the queue was full: write it ourselves
+	}
+
+	std::string line;
+	std::lock_guard<std::mutex> lock(_writeMutex);
+	line.append(stamp(entry.ms)).append(entry.text).push_back('\n');
+	flush(entry.stream == INFO ? line : std::string(), entry.stream == ERROR ? line : std::string(),
+		entry.console ? line : std::string());
+}
+
+/**
+ * @brief Flusher: drain the queue in batches, one write per stream and batch
+ */
+void Logger::run() {
+	t_entry		entry;
+	std::string	info, error, console;
+	size_t		batch;
+
+	traceThreadName("logger");
+	while (_queue.pop(entry)) {
+		std::lock_guard<std::mutex> lock(_writeMutex);
+		batch = 0;
+		do {
+			format(entry, info, error, console);
+		} while (++batch < LOG_BATCH_SIZE && _queue.tryPop(entry));
+		flush(info, error, console);
+		info.clear();
+		error.clear();
+		console.clear();
+	}
+}
+
+/**
+ * @brief Write out whatever is still queued once the flusher may be gone
+ */
+void Logger::drain() {
+	t_entry		entry;
+	std::string	info, error, console;
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	std::lock_guard<std::mutex> lock(_writeMutex);
+	while (_queue.tryPop(entry))
+		format(entry, info, error, console);
+	flush(info, error, console);
+}
+
+/**
+ * @brief Append the line of entry to the buffers of its streams. Caller holds _writeMutex.
+ */
+void Logger::format(const t_entry &entry, std::string &info, std::string &error, std::string &console) {
+	const char *prefix = stamp(entry.ms);
+	std::string &out = entry.stream == INFO ? info : error;
+
+	out.append(prefix).append(entry.text).push_back('\n');
+	if (entry.console)
+		console.append(prefix).append(entry.text).push_back('\n');
+}
+
+/**
+ * @brief "[HH:MM:SS.mmm] " for ms, reformatting only what changed since the last call
+ */
+const char *Logger::stamp(int64_t ms) {
+	if (ms == _stampMs)
+		return _stamp;
+
+	std::time_t sec = static_cast<std::time_t>(ms / 1000);
+	if (sec != _stampSec) {
+		std::tm local_tm;
+		localtime_r(&sec, &local_tm);
+		std::snprintf(_stamp, sizeof(_stamp), "[%02d:%02d:%02d.000] ",
+			local_tm.tm_hour, local_tm.tm_min, local_tm.tm_sec);
+		_stampSec = sec;
+	}
+	int milli = static_cast<int>(ms % 1000);
+	_stamp[10] = static_cast<char>('0' + milli / 100);
+	_stamp[11] = static_cast<char>('0' + milli / 10 % 10);
+	_stamp[12] = static_cast<char>('0' + milli % 10);
+	_stampMs = ms;
+	return _stamp;
+}
+
+/**
+ * @brief Write formatted lines to their streams. Caller holds _writeMutex.
+ */
+void Logger::flush(const std::string &info, const std::string &error, const std::string &console) {
+	if (!info.empty() && _info.is_open()) {
+		_info << info;
+		_info.flush();
+	}
+	for (size_t done = 0; done < error.size(); ) {
+		ssize_t n = ::write(STDERR_FILENO, error.data() + done, error.size() - done);
+		if (n <= 0)
+			break;
+		done += static_cast<size_t>(n);
+	}
+	if (!console.empty()) {
+		auto lock = traceLock<std::unique_lock<std::mutex> >(_consoleMutex, "console");
+		std::cout << console;
+		std::cout.flush();
+	}
+}
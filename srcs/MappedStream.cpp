@@ -0,0 +1,89 @@
+#include "MappedStream.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedStream::MappedStream(const std::string &path)
+	: _path(path) {
+	int			fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat	st;
+	void		*map;
+
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		map = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			_data = static_cast<const char *>(map);
+			_size = static_cast<size_t>(st.st_size);
+			// Tags are read front to back, then the ID3v1/APE footer: let readahead run ahead
+			madvise(map, _size, MADV_SEQUENTIAL);
+		}
+	}
+	// The mapping keeps the file referenced
+	close(fd);
+}
+
+MappedStream::~MappedStream() {
+	if (_data)
+		munmap(const_cast<char *>(_data), _size);
+}
+
+TagLib::FileName MappedStream::name() const {
+	return _path.c_str();
+}
+
+TagLib::ByteVector MappedStream::readBlock(t_streamLength length) {
+	if (_pos >= _size || length == 0)
+		return TagLib::ByteVector();
+	if (length > _size - _pos)
+		length = static_cast<t_streamLength>(_size - _pos);
+	TagLib::ByteVector block(_data + _pos, static_cast<unsigned int>(length));
+	_pos += length;
+	return block;
+}
+
+void MappedStream::writeBlock(const TagLib::ByteVector &) {}
+
+void MappedStream::insert(const TagLib::ByteVector &, t_streamStart, t_streamLength) {}
+
+void MappedStream::removeBlock(t_streamStart, t_streamLength) {}
+
+bool MappedStream::readOnly() const {
+	return true;
+}
+
+bool MappedStream::isOpen() const {
+	return _data != nullptr;
+}
+
+void MappedStream::seek(t_streamOffset offset, Position p) {
+	long long	base = 0;
+
+	if (p == Current)
+		base = static_cast<long long>(_pos);
+	else if (p == End)
+		base = static_cast<long long>(_size);
+	base += offset;
+	// Like FileStream, seeking past the end is allowed and reads nothing
+	_pos = base < 0 ? 0 : static_cast<size_t>(base);
+}
+
+t_streamOffset MappedStream::tell() const {
+	return static_cast<t_streamOffset>(_pos);
+}
+
+t_streamOffset MappedStream::length() {
+	return static_cast<t_streamOffset>(_size);
+}
+
+void MappedStream::truncate(t_streamOffset) {}
+
+const char *MappedStream::data() const {
+	return _data;
+}
+
+size_t MappedStream::size() const {
+	return _size;
+}
@@ -1,45 +1,219 @@
 #include "../includes/Utils.hpp"
 #include "../includes/Database.hpp"
+#include "../includes/BoundedQueue.hpp"
+#include "../includes/ContentHash.hpp"
+#include "../includes/Id3Reader.hpp"
+#include "../includes/Id3Writer.hpp"
+#include "../includes/MappedStream.hpp"
+#include "../includes/Trace.hpp"
+#include <cstdio>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <unordered_set>
 
 static std::atomic<size_t>	g_NumDbEntries(0);
-static std::mutex			g_numDbEntriesMutex;
-std::mutex					g_statsMutex;
-t_stats						g_stats = {0, 0, 0, 0};
-static std::mutex			g_imageMutex;
+static std::atomic<size_t>	g_unusedIds(0);
 
 /**
- * @brief Handle a new file by adding a "42id" frame to the ID3v2 tag.
+ * @brief 42ids handed out during this run, persisted in log_additions ahead of use
+ */
+typedef struct s_idReservation
+{
+	std::mutex			mutex;
+	Database			*db = nullptr;	// Open for the whole run, only used under mutex
+	LogAddition			entry = {};	// This run's row, inserted with the first block
+	std::atomic<size_t>	persisted{0};	// Highest id committed as last_id of entry
+}	t_idReservation;
+
+static t_idReservation	g_ids;
+
+typedef std::unordered_map<std::string, FileState>	t_fileStates;
+
+/**
+ * @brief A song travelling through the ingestion pipeline
  *
- * This function creates a new "42id" frame with a unique identifier
- * corresponding to the current number of database entries + 1.
- * It adds this frame to the ID3v2 tag of the given file and saves it.
- * 
- * @param path The file path of the song being processed.
- * @param tag Pointer to the ID3v2 tag of the file.
- * @param file Reference to the TagLib::MPEG::File object representing the song.
+ * Each stage fills in its part. A stage drops the job, counting it as done, as
+ * soon as nothing is left to do for it downstream.
  */
-static void handleNewFile(const std::string &path, TagLib::ID3v2::Tag *tag, TagLib::MPEG::File &file)
+typedef struct s_songJob
 {
-	{
-		std::lock_guard<std::mutex> lock(g_numDbEntriesMutex);
-		size_t id = g_NumDbEntries + 1;
-		auto *frame_id = new TagLib::ID3v2::UserTextIdentificationFrame;
-		frame_id->setDescription("42id");
-		frame_id->setText(std::to_string(id));
-		tag->addFrame(frame_id);
-
-		if (!file.save()) {
-			std::cerr << "Failed to save ID3v2 tag for " << path << "\n";
-			std::lock_guard<std::mutex> lock(g_statsMutex);
-			g_stats.errors++;
+	FileState								state;
+	SongRecord								song;
+	bool									known = false;	// A state was recorded on a previous run
+	bool									needsId = false;	// No 42id yet: the tag write stage must add one
+	std::unique_ptr<MappedStream>			mapping;		// The song's bytes, while coverData points into them
+	TagLib::ByteVector						cover;			// APIC payload read by TagLib, when it had to parse the tag
+	std::string_view						coverData;		// Raw cover bytes, in mapping or cover (never copied)
+	cv::Mat									image;			// Decoded cover, set only when it is new
+	std::string								coverPath;		// Where the new cover was saved, relative to IMG_DIR
+	uint64_t								imageHash = 0;
+	uint64_t								coverDigest = 0;	// Content hash of the raw APIC payload
+	uint32_t								imageId = 0;
+}	t_songJob;
+
+typedef std::unique_ptr<t_songJob>	t_songJobPtr;
+typedef BoundedQueue<t_songJobPtr>	t_songQueue;
+
+/**
+ * @brief Image ids whose cover could not be saved during this run
+ *
+ * Songs may have been linked to such an id, by a digest or near-duplicate
+ * match, before the save failed. Digest hits on them are ignored and the links
+ * are cleared once the run is over.
+ */
+typedef struct s_failedCovers
+{
+	std::mutex						mutex;
+	std::unordered_set<uint32_t>	ids;
+	std::atomic<bool>				any{false};	// Lets lookups skip the lock while nothing failed
+}	t_failedCovers;
+
+/**
+ * @brief State shared by all pipeline stages of a run
+ */
+typedef struct s_songsContext
+{
+	const t_paths			&paths;
+	HashStore				&hashes;
+	DigestIndex				&digests;
+	t_failedCovers			&failed;
+	const t_imageConfig		&image;
+	const t_fileStates		&known;
+	bool					backfill;	// Reprocess the given songs even if unchanged
+}	t_songsContext;
+
+static void	addError()
+{
+	addStat(threadStats().errors);
+}
+
+static bool	isFailedCover(t_failedCovers &failed, uint32_t id)
+{
+	if (!failed.any.load(std::memory_order_acquire))
+		return false;
+	std::lock_guard<std::mutex> lock(failed.mutex);
+	return failed.ids.count(id) != 0;
+}
+
+/**
+ * @brief Count a song as done, whichever stage it left the pipeline at
+ */
+static void	finishJob()
+{
+	addStat(threadStats().processed);
+}
+
+/**
+ * @brief Pop from a pipeline queue, tracing the time spent waiting for input
+ */
+template<typename T>
+static bool	popTraced(BoundedQueue<T> &queue, T &out)
+{
+	if (queue.tryPop(out))
+		return true;
+	TRACE_SPAN("wait input");
+	return queue.pop(out);
+}
+
+/**
+ * @brief Push to a pipeline queue, tracing the time spent waiting for room
+ */
+template<typename T>
+static bool	pushTraced(BoundedQueue<T> &queue, T item)
+{
+	if (queue.tryPush(item))
+		return true;
+	TRACE_SPAN("wait output");
+	return queue.push(std::move(item));
+}
+
+/**
+ * @brief Add a "42id" frame through TagLib, saving the ID3v2 tag only.
+ *
+ * Fallback for tags addId3UserText() does not handle. Other tags are neither
+ * stripped nor duplicated, so ID3v1 is not rewritten as a side effect.
+ */
+static bool	saveIdWithTagLib(const std::string &path, const std::string &id)
+{
+	TagLib::MPEG::File	file(path.c_str());
+
+	if (!file.isValid() || !file.ID3v2Tag())
+		return false;
+
+	auto *frame_id = new TagLib::ID3v2::UserTextIdentificationFrame;
+	frame_id->setDescription("42id");
+	frame_id->setText(id);
+	file.ID3v2Tag()->addFrame(frame_id);
+#if TAGLIB_MAJOR_VERSION >= 2
+	return file.save(TagLib::MPEG::File::ID3v2, TagLib::File::StripNone, TagLib::ID3v2::v4, TagLib::File::DoNotDuplicate);
+#else
+	return file.save(TagLib::MPEG::File::ID3v2, false, 4, false);
+#endif
+}
+
+/**
+ * @brief Hand out the next 42id, or 0 if it could not be persisted first.
+ *
+ * Ids come from a bare atomic increment while they lie in the persisted range.
+ * Past it, the range is extended by ID_BLOCK_SIZE ids at a time: last_id of
+ * this run's log_additions row is raised and committed before any id of the
+ * block reaches a file. A run that crashes or is interrupted then never leaves
+ * an id in a song that getLastSongId() would hand out again.
+ */
+static size_t	reserveId()
+{
+	size_t id = g_NumDbEntries.fetch_add(1) + 1;
+
+	if (id <= g_ids.persisted.load(std::memory_order_acquire))
+		return id;
+
+	auto lock = traceLock<std::unique_lock<std::mutex> >(g_ids.mutex, "id reservation");
+	while (id > g_ids.persisted.load(std::memory_order_relaxed)) {
+		TRACE_SPAN("log_additions write");
+		LogAddition entry = g_ids.entry;
+		entry.last_id = static_cast<int>(g_ids.persisted.load(std::memory_order_relaxed) + ID_BLOCK_SIZE);
+		if (!(entry.id == 0 ? g_ids.db->insertLogAddition(entry) : g_ids.db->updateLogAddition(entry))) {
+			logError("Failed to reserve ids up to " + std::to_string(entry.last_id) + " in log_additions.");
+			return 0;
 		}
-		g_NumDbEntries++;
+		g_ids.entry = entry;
+		g_ids.persisted.store(static_cast<size_t>(entry.last_id), std::memory_order_release);
 	}
-	{
-		std::lock_guard<std::mutex> lock(g_statsMutex);
-		g_stats.newFiles++;
+	return id;
+}
+
+/**
+ * @brief Handle a new file by adding a "42id" frame to its ID3v2 tag.
+ *
+ * This function reserves the next identifier with reserveId() and writes a
+ * "42id" frame holding it. The frame goes into the tag's padding in
+ * place when possible; a tag without room is grown once with spare padding.
+ * Tags the native writer does not handle are saved by TagLib. No lock is held
+ * during the save, so new files are tagged in parallel. Ids of failed saves
+ * stay unused and are counted in g_unusedIds.
+ *
+ * @param path The file path of the song being processed.
+ * @return The id written to the file, or an empty string if saving failed.
+ */
+static std::string handleNewFile(const std::string &path)
+{
+	TRACE_SPAN("tag save");
+	std::string saved;
+	size_t reserved = reserveId();
+	std::string id = std::to_string(reserved);
+
+	if (reserved == 0)
+		addError();
+	else if (!addId3UserText(path, "42id", id) && !saveIdWithTagLib(path, id)) {
+		logError("Failed to save ID3v2 tag for " + path);
+		g_unusedIds++;
+		addError();
 	}
+	else
+		saved = id;
+	addStat(threadStats().newFiles);
 	log("Adding new song: " + path, false);
+	return saved;
 }
 
 /**
@@ -92,170 +266,665 @@ static bool	extractID3v2Metadata(const TagLib::ID3v2::FrameList &frames,
 }
 
 /**
- * @brief Process a song's embedded image: decode, resize, hash and save.
- * 
- * Extracts the embedded picture (APIC frame) from an MP3 file's ID3v2 tag,
- * resizes it to PIC_QUALITY x PIC_QUALITY using high-quality interpolation,
- * converts it to grayscale to compute a perceptual hash, checks for duplicates,
- * and saves the image in JPEG format with high quality if unique.
- * 
- * @param paths Struct containing output paths (e.g., image directory).
- * @param hashes Vector storing perceptual hashes of previously processed images.
- * @param hasher OpenCV perceptual hash algorithm instance.
- * @param tag Pointer to the ID3v2 tag of the song file.
+ * @brief Read the pixel size of a JPEG from its first SOF segment.
+ *
+ * @return false if data is not a JPEG or no frame header precedes the scan.
  */
-static void	processSongImage(const t_paths &paths, std::vector<cv::Mat> &hashes, cv::Ptr<cv::img_hash::PHash> &hasher, TagLib::ID3v2::Tag *tag)
+static bool	jpegSize(const uint8_t *data, size_t size, int &width, int &height)
 {
-	// Retrieve ID3v2 tag and get the list of attached pictures (APIC frames)
-	const TagLib::ID3v2::FrameList &frames = tag->frameList("APIC");
+	size_t	pos = 2;
+	uint8_t	marker;
+	size_t	length;
 
-	if (frames.isEmpty())
-		return;
+	if (size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+		return false;
+	while (pos + 4 <= size)
+	{
+		if (data[pos] != 0xFF)
+			return false;
+		while (pos < size && data[pos] == 0xFF) // Fill bytes
+			++pos;
+		if (pos + 3 > size)
+			return false;
+		marker = data[pos++];
+		if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) // No payload
+			continue;
+		if (marker == 0xD9 || marker == 0xDA) // End of image or start of scan
+			return false;
+		length = (static_cast<size_t>(data[pos]) << 8) | data[pos + 1];
+		if (length < 2 || pos + length > size)
+			return false;
+		// SOF0-SOF15, except DHT (C4), JPG (C8) and DAC (CC)
+		if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+		{
+			if (length < 7)
+				return false;
+			height = (data[pos + 3] << 8) | data[pos + 4];
+			width = (data[pos + 5] << 8) | data[pos + 6];
+			return width > 0 && height > 0;
+		}
+		pos += length;
+	}
+	return false;
+}
 
-	// Extract the first attached picture frame
-	TagLib::ID3v2::AttachedPictureFrame *apic = dynamic_cast<TagLib::ID3v2::AttachedPictureFrame *>(frames.front());
-	if (!apic)
+/**
+ * @brief imdecode flags decoding a cover no smaller than needed.
+ *
+ * JPEGs at least 2, 4 or 8 times larger than PIC_QUALITY on both sides are
+ * decoded at that scale by libjpeg's DCT scaling, which skips most of the
+ * decode work and leaves the final resize a much smaller source.
+ */
+static int	decodeFlags(const uint8_t *data, size_t size)
+{
+	int	width;
+	int	height;
+	int	side;
+
+	if (!jpegSize(data, size, width, height))
+		return cv::IMREAD_COLOR;
+	side = std::min(width, height);
+	if (side >= PIC_QUALITY * 8)
+		return cv::IMREAD_REDUCED_COLOR_8;
+	if (side >= PIC_QUALITY * 4)
+		return cv::IMREAD_REDUCED_COLOR_4;
+	if (side >= PIC_QUALITY * 2)
+		return cv::IMREAD_REDUCED_COLOR_2;
+	return cv::IMREAD_COLOR;
+}
+
+/**
+ * @brief Image stage: decode and hash a song's cover, then dedupe it.
+ *
+ * Payloads already seen byte for byte, typically the same cover embedded in
+ * every track of an album, are recognised by their content hash and never
+ * decoded again. Otherwise the payload is decoded at the smallest scale still
+ * covering PIC_QUALITY and hashed from a thumbnail taken straight from it. If
+ * no near duplicate is known, an image id is reserved and the decoded image is
+ * kept on the job for the encode stage. Either way the song is linked to the
+ * id of its cover.
+ *
+ * @param job Song whose cover was extracted by the parse stage.
+ * @param ctx State shared by all stages (perceptual hashes and payload digests).
+ */
+static void	decodeCover(t_songJob &job, const t_songsContext &ctx)
+{
+	// Whatever holds the payload is released on return, whether it was decoded or not
+	const std::unique_ptr<MappedStream>	mapping = std::move(job.mapping);
+	const TagLib::ByteVector			imgData = job.cover;
+	const std::string_view				payload = job.coverData;
+	job.cover = TagLib::ByteVector();
+	job.coverData = std::string_view();
+	if (payload.empty())
 		return;
 
-	// Get raw image data from the attached picture frame
-	TagLib::ByteVector imgData = apic->picture();
+	const uint8_t *bytes = reinterpret_cast<const uint8_t *>(payload.data());
+	{
+		TRACE_SPAN("content hash");
+		job.coverDigest = contentHash(bytes, payload.size());
+	}
+	if (ctx.digests.find(job.coverDigest, job.imageId) && !isFailedCover(ctx.failed, job.imageId)) {
+		job.song.cover = static_cast<int>(job.imageId);
+		return; // Exact same payload as an earlier cover: nothing to decode
+	}
 
-	std::vector<uchar> imgBuffer(imgData.begin(), imgData.end());
-	cv::Mat rawData(1, imgBuffer.size(), CV_8UC1, imgBuffer.data());
+	// Wrap the payload without copying it, imdecode only reads from it
+	const cv::Mat rawData(1, static_cast<int>(payload.size()), CV_8UC1, const_cast<uint8_t *>(bytes));
 
-	// Decode the image from memory buffer as a color image
-	cv::Mat img = cv::imdecode(rawData, cv::IMREAD_COLOR);
+	// Decode the image from memory buffer as a color image, letting libjpeg scale large ones down
+	cv::Mat img;
+	{
+		TRACE_SPAN("imdecode");
+		img = cv::imdecode(rawData, decodeFlags(bytes, payload.size()));
+	}
 	if (img.empty())
 		return;
 
-	// Resize image to fixed size with high-quality Lanczos interpolation
-	cv::resize(img, img, cv::Size(PIC_QUALITY, PIC_QUALITY), 0, 0, cv::INTER_LANCZOS4);
+	uint64_t hash;
+	{
+		TRACE_SPAN("phash");
+		hash = coverHash(img);
+	}
+	// Check for a near duplicate and reserve an image id in one step; nothing else is locked
+	bool inserted;
+	{
+		TRACE_SPAN("hash lookup");
+		inserted = ctx.hashes.insertUnique(hash, job.imageId);
+	}
+	ctx.digests.insert(job.coverDigest, job.imageId);
+	// Either the new cover's reserved id or the one of the stored cover it matched
+	job.song.cover = static_cast<int>(job.imageId);
+	if (!inserted)
+		return; // Duplicate found: skip resizing and saving
+
+	job.image = img;
+	job.imageHash = hash;
+}
+
+/**
+ * @brief Encode stage: resize a new cover and save it as a high quality JPEG.
+ *
+ * The cover is resized to PIC_QUALITY x PIC_QUALITY with the configured kernel,
+ * only now that it is known to be new, and stored at coverPath() of its hash.
+ * The DB writer records it in the covers table. On failure the reservation
+ * made by decodeCover() is released, so later covers are not matched against a
+ * missing file, and the id is marked failed so that songs already linked to it
+ * are unlinked at the end of the run.
+ *
+ * @param job Song whose cover was found to be new by the image stage.
+ * @param ctx State shared by all stages (output paths, hashes, resize kernel).
+ */
+static void	saveCover(t_songJob &job, const t_songsContext &ctx)
+{
+	if (job.image.empty())
+		return;
+
+	// Resize image to fixed size with the configured interpolation
+	{
+		TRACE_SPAN("resize");
+		cv::resize(job.image, job.image, cv::Size(PIC_QUALITY, PIC_QUALITY), 0, 0, ctx.image.resizeKernel);
+	}
 
 	// Set JPEG compression params: quality = 95 (high quality)
 	std::vector<int> compression_params;
 	compression_params.push_back(cv::IMWRITE_JPEG_QUALITY);
 	compression_params.push_back(95);
 
-	// Convert resized image to grayscale for hashing
-	cv::Mat gray;
-	cv::cvtColor(img, gray, cv::COLOR_BGR2GRAY);
+	const std::string relative_path = coverPath(job.imageHash);
+	const std::string output_path = ctx.paths.images + "/" + relative_path;
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path(output_path).parent_path(), ec);
+
+	bool saved = false;
+	TRACE_SPAN("imwrite");
+	try {
+		saved = cv::imwrite(output_path, job.image, compression_params);
+	} catch (const cv::Exception &e) {
+		logError("Exception while writing " + output_path + ": " + e.what());
+	}
+	job.image.release();
+	if (!saved) {
+		logError("Failed to write image " + output_path);
+		std::remove(output_path.c_str());
+		ctx.hashes.erase(job.imageHash, job.imageId);
+		ctx.digests.erase(job.coverDigest);
+		{
+			std::lock_guard<std::mutex> lock(ctx.failed.mutex);
+			ctx.failed.ids.insert(job.imageId);
+		}
+		ctx.failed.any.store(true, std::memory_order_release);
+		job.song.cover.reset();
+		addError();
+		return;
+	}
+	job.coverPath = relative_path;
+	addStat(threadStats().newImages);
+}
 
-	cv::Mat hash;
-	hasher->compute(gray, hash);
+/**
+ * @brief Fill size, mtime (ns) and inode of path from a single stat call.
+ */
+static bool	statFile(const std::string &path, FileState &state)
+{
+	struct stat	st;
+
+	if (stat(path.c_str(), &st) != 0)
+		return false;
+	state.size = static_cast<long long>(st.st_size);
+	state.mtime = static_cast<long long>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+	state.inode = static_cast<long long>(st.st_ino);
+	return true;
+}
 
-	std::lock_guard<std::mutex> lock(g_imageMutex);
+/**
+ * @brief Ask the kernel to start reading the parts of a song TagLib will parse.
+ *
+ * The ID3v2 tag and first frames sit at the start of the file, ID3v1/APE tags at
+ * the end. The read-ahead runs asynchronously while the job waits for a parser.
+ */
+static void	prefetchFile(const std::string &path, long long size)
+{
+	int	fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
 
-	// Check if this hash is already present (duplicate detection)
-	for (const cv::Mat &existing : hashes)
-	{
-		if (cv::norm(hash, existing, cv::NORM_HAMMING) < HAMMING_THRESHOLD)
-			return; // Duplicate found: skip saving
-	}
+	if (fd < 0)
+		return;
+	posix_fadvise(fd, 0, std::min<long long>(size, PREFETCH_BYTES), POSIX_FADV_WILLNEED);
+	if (size > PREFETCH_BYTES)
+		posix_fadvise(fd, size - PREFETCH_TAIL_BYTES, PREFETCH_TAIL_BYTES, POSIX_FADV_WILLNEED);
+	::close(fd);
+}
 
-	hashes.push_back(hash.clone());
+/**
+ * @brief First value stored under key in the extracted metadata, or an empty string
+ */
+static std::string	metadataValue(const std::multimap<std::string, std::string> &metadata, const std::string &key)
+{
+	auto it = metadata.find(key);
+	return it == metadata.end() ? std::string() : it->second;
+}
 
-	std::string output_path = paths.images + "/" + std::to_string(hashes.size()) + ".jpg";
-	cv::imwrite(output_path, img, compression_params);
-	{
-		std::lock_guard<std::mutex> stats_lock(g_statsMutex);
-		g_stats.newImages++;
-	}
+/**
+ * @brief Fill a song from a tag read by the native ID3v2 reader
+ */
+static void	fillFromId3(t_songJob &job, const t_id3Tag &tag, long length_ms)
+{
+	SongRecord	&song = job.song;
+
+	if (tag.has42id)
+		song.id = id3Text(tag.id42Encoding, tag.id42);
+	song.title = id3Text(tag.title);
+	song.artist = id3Text(tag.artist);
+	song.album = id3Text(tag.album);
+	song.tags = id3Text(tag.genre);
+	song.duration = length_ms / 1000.0;
+	job.coverData = tag.picture; // Points into the mapping, kept alive on the job
+	job.needsId = !tag.has42id;
 }
 
-static void	songsThread(const std::vector<std::string> &song_files, size_t start, size_t end, const t_paths &paths, std::vector<cv::Mat> &hashes)
+/**
+ * @brief Fill a song by letting TagLib parse the mapped file
+ *
+ * @return false if TagLib finds no ID3v2 tag.
+ */
+static bool	parseWithTagLib(t_songJob &job)
 {
-	size_t		i;
-	Database	db(paths.root + "/songs.db");
+	TRACE_SPAN("TagLib parse");
+	const std::string	&path = job.state.path;
+	SongRecord			&song = job.song;
+
+#if TAGLIB_MAJOR_VERSION >= 2
+	TagLib::MPEG::File	file(job.mapping.get());
+#else
+	TagLib::MPEG::File	file(job.mapping.get(), TagLib::ID3v2::FrameFactory::instance());
+#endif
+	if (!file.isValid() || !file.ID3v2Tag()) {
+		logError("Failed to read ID3v2 tag for " + path);
+		addError();
+		return false;
+	}
 
-	if (start >= end || end > song_files.size()) {
-		std::cerr << "Invalid range [" << start << ", " << end << ")\n";
-		return;
+	TagLib::ID3v2::Tag *tag = file.ID3v2Tag();
+	std::multimap<std::string, std::string> metadata;
+	bool has42id = extractID3v2Metadata(tag->frameList(), metadata);
+	if (has42id)
+		song.id = metadataValue(metadata, "TXXX:42id");
+	song.title = metadataValue(metadata, "TIT2");
+	song.artist = metadataValue(metadata, "TPE1");
+	song.album = metadataValue(metadata, "TALB");
+	song.tags = metadataValue(metadata, "TCON");
+	song.duration = file.audioProperties() ? file.audioProperties()->lengthInMilliseconds() / 1000.0 : 0.0;
+
+	// Keep the first attached picture; the payload is shared, not copied
+	const TagLib::ID3v2::FrameList &pictures = tag->frameList("APIC");
+	if (!pictures.isEmpty()) {
+		TagLib::ID3v2::AttachedPictureFrame *apic = dynamic_cast<TagLib::ID3v2::AttachedPictureFrame *>(pictures.front());
+		if (apic) {
+			job.cover = apic->picture();
+			// Read through a const reference: data() would otherwise detach the shared buffer
+			const TagLib::ByteVector &cover = job.cover;
+			job.coverData = std::string_view(cover.data(), cover.size());
+		}
 	}
+	job.mapping.reset(); // TagLib copied what it read
+	job.needsId = !has42id;
+	return true;
+}
 
-	if (!db.open()) {
-		std::cerr << "Failed to open database.\n";
-		return;
+/**
+ * @brief Parse stage: read the tags of a song and extract its metadata and cover.
+ *
+ * The file is mapped with a MappedStream, so reads are served from memory the
+ * read stage already asked the kernel to prefetch. Plain ID3v2.3/2.4 tags are
+ * read in place by the native reader, without building TagLib's frame objects;
+ * anything it does not fully understand is parsed by TagLib from the same
+ * mapping.
+ *
+ * @return false if the song cannot be processed any further.
+ */
+static bool	parseSong(t_songJob &job)
+{
+	const std::string	&path = job.state.path;
+	t_id3Tag			tag;
+	long				lengthMs = -1;
+
+	job.mapping.reset(new MappedStream(path));
+	if (!job.mapping->isOpen()) {
+		logError("Failed to map " + path);
+		addError();
+		return false;
 	}
 
-	cv::Ptr<cv::img_hash::PHash> hasher = cv::img_hash::PHash::create();
+	if (readId3v2(job.mapping->data(), job.mapping->size(), tag)
+		&& (lengthMs = mpegLengthMs(job.mapping->data(), job.mapping->size(), tag.audioStart)) >= 0)
+		fillFromId3(job, tag, lengthMs);
+	else if (!parseWithTagLib(job))
+		return false;
+	if (!job.needsId && job.known)
+		addStat(threadStats().updatedFiles);
+	job.song.path = path;
+	return true;
+}
+
+/**
+ * @brief Tag write stage: give new files their 42id, then refresh their state.
+ *
+ * @return false if there is nothing left to record: no id to store the song
+ * under and no new cover.
+ */
+static bool	writeSongTag(t_songJob &job)
+{
+	if (job.needsId) {
+		job.song.id = handleNewFile(job.state.path);
+		// Stat again: saving a new id changes the mtime, and the inode when the tag grew
+		if (!job.song.id.empty() && !statFile(job.state.path, job.state)) {
+			logError("Failed to stat " + job.state.path);
+			addError();
+			job.song.id.clear();
+		}
+	}
+	job.state.id = job.song.id;
+	// A saved cover is recorded even when its song could not be
+	return !job.song.id.empty() || !job.coverPath.empty();
+}
 
-	i = start;
-	while (i < end)
+/**
+ * @brief Read stage: stat songs as the scan finds them, skip unchanged ones and prefetch the rest.
+ *
+ * Files whose size, mtime and inode match the state recorded on the last run
+ * are skipped without being opened.
+ *
+ * @param in Paths streamed by the directory scan, closed once it is done.
+ * @param ctx State shared by all stages.
+ * @param out Queue of the parse stage.
+ * @param running Readers still running; the last one closes out.
+ */
+static void	readThread(BoundedQueue<std::string> &in, const t_songsContext &ctx,
+						t_songQueue &out, std::atomic<unsigned int> &running)
+{
+	std::string	path;
+
+	traceThreadName("read");
+	while (popTraced(in, path))
 	{
-		const std::string	&path = song_files[i];
+		TRACE_SPAN("read");
+		t_songJobPtr	job(new t_songJob);
+		FileState		&state = job->state;
+
+		state.path = std::move(path);
+		if (!statFile(state.path, state)) {
+			logError("Failed to stat " + state.path);
+			addError();
+			finishJob();
+			continue;
+		}
 
-		try {
-			TagLib::MPEG::File	file(path.c_str());
-			std::multimap<std::string, std::string> metadata;
+		t_fileStates::const_iterator prev = ctx.known.find(state.path);
+		job->known = prev != ctx.known.end();
+		if (!ctx.backfill && job->known && !prev->second.id.empty() && prev->second.size == state.size
+			&& prev->second.mtime == state.mtime && prev->second.inode == state.inode) {
+			addStat(threadStats().unchanged);
+			finishJob();
+			continue;
+		}
 
-			if (!file.isValid() || !file.ID3v2Tag()) {
-				std::cerr << "Failed to read ID3v2 tag for " << path << "\n";
-				std::lock_guard<std::mutex> lock(g_statsMutex);
-				g_stats.errors++;
-			}
-			else {
-				TagLib::ID3v2::Tag *tag = file.ID3v2Tag();
-				const TagLib::ID3v2::FrameList &frames = tag->frameList();
-				bool has42id = extractID3v2Metadata(frames, metadata);
-				if (!has42id)
-					handleNewFile(path, tag, file);
-				processSongImage(paths, hashes, hasher, tag);
-			}
+		{
+			TRACE_SPAN("prefetch");
+			prefetchFile(state.path, state.size);
+		}
+		pushTraced(out, std::move(job));
+	}
+	if (--running == 0)
+		out.close();
+}
+
+/**
+ * @brief Generic pipeline stage worker.
+ *
+ * Applies step to every job popped from in and forwards it to out, unless step
+ * returns false or throws, in which case the job is done. The last worker of
+ * the stage to finish closes out. Each step is traced as a span named after
+ * the stage.
+ */
+template<typename Step>
+static void	stageThread(const char *name, t_songQueue &in, t_songQueue &out, std::atomic<unsigned int> &running, Step step)
+{
+	t_songJobPtr	job;
+	bool			keep;
+
+	traceThreadName(name);
+	while (popTraced(in, job))
+	{
+		keep = false;
+		try {
+			TRACE_SPAN(name);
+			keep = step(*job);
 		} catch (const std::exception &e) {
-			std::cerr << "Exception while processing " << path << ": " << e.what() << "\n";
-			std::lock_guard<std::mutex> lock(g_statsMutex);
-			g_stats.errors++;
+			logError("Exception while processing " + job->state.path + ": " + e.what());
+			addError();
 		}
+		if (keep)
+			pushTraced(out, std::move(job));
+		else
+			finishJob();
+		job.reset();
+	}
+	if (--running == 0)
+		out.close();
+}
 
-		displayProgress(g_progressCount++, song_files.size());
-		++i;
+/**
+ * @brief Start count workers of a stage; makeStep() builds each worker's own step.
+ *
+ * @param name Static name of the stage, used for its threads and spans in the trace.
+ */
+template<typename MakeStep>
+static void	startStage(const char *name, unsigned int count, t_songQueue &in, t_songQueue &out,
+						std::atomic<unsigned int> &running, MakeStep makeStep, std::vector<std::thread> &threads)
+{
+	running = count;
+	for (unsigned int i = 0; i < count; ++i)
+		threads.emplace_back(stageThread<decltype(makeStep())>, name, std::ref(in), std::ref(out), std::ref(running), makeStep());
+}
+
+/**
+ * @brief DB write stage: a single writer drains the queue and commits in large batches.
+ *
+ * Only this thread writes to songs.db during a run, so workers never contend on
+ * SQLite locks and rows are not fsynced one at a time.
+ *
+ * @param db_path Path of the SQLite database.
+ * @param db_config Connection tuning.
+ * @param queue Queue of processed songs, closed once the tag write stage is done.
+ */
+static void	dbWriterThread(const std::string &db_path, const DbConfig &db_config, t_songQueue &queue)
+{
+	Database		db(db_path, db_config);
+	t_songJobPtr	job;
+	size_t			batch;
+	bool			isNew;
+
+	traceThreadName("db writer");
+	if (!db.open()) {
+		logError("Failed to open database.");
+		while (queue.pop(job))
+			finishJob(); // Keep draining so upstream stages never block on a full queue
+		return;
+	}
+
+	while (popTraced(queue, job))
+	{
+		TRACE_SPAN("db batch");
+		db.beginTransaction();
+		batch = 0;
+		do {
+			if (!job->song.id.empty() && !db.upsertSong(job->song, isNew))
+				logError("Failed to save song " + job->song.path);
+			if (!job->song.id.empty() && !db.upsertFileState(job->state))
+				logError("Failed to record file state for " + job->state.path);
+			if (!job->coverPath.empty()
+				&& !db.insertCover({static_cast<int>(job->imageId), job->imageHash, job->coverPath}))
+				logError("Failed to record cover " + job->coverPath);
+			finishJob();
+		} while (++batch < DB_BATCH_SIZE && queue.tryPop(job));
+		TRACE_SPAN("db commit");
+		if (!db.commitTransaction()) {
+			db.rollbackTransaction();
+			addStat(threadStats().errors, batch);
+		}
 	}
 	db.close();
 }
 
+/**
+ * @brief Start this run's log_additions row, inserted by reserveId() with the first block.
+ */
+static void	startAdditions(Database &db, size_t last_id)
+{
+	std::time_t	now = std::time(nullptr);
+	std::tm		local_tm;
+	localtime_r(&now, &local_tm);
+
+	g_ids.db = &db;
+	g_ids.entry = LogAddition();
+	g_ids.entry.id = 0;
+	g_ids.entry.year = local_tm.tm_year + 1900;
+	g_ids.entry.month = local_tm.tm_mon + 1;
+	g_ids.entry.day = local_tm.tm_mday;
+	g_ids.entry.first_id = static_cast<int>(last_id + 1);
+	g_ids.entry.last_id = static_cast<int>(last_id);
+	g_ids.entry.comment = "reserved by a run that did not finish";
+	g_ids.persisted = last_id;
+}
+
+/**
+ * @brief Close this run's log_additions row on the range of ids actually handed out.
+ *
+ * Every tag writer has finished, so no id past g_NumDbEntries reached a file and
+ * the unused tail of the last block is given back. Ids left unused by failed
+ * saves stay in the range; getLastSongId() never hands them out again.
+ */
+static void	finishAdditions(Database &db)
+{
+	LogAddition	&entry = g_ids.entry;
+	size_t		last_id = g_NumDbEntries.load();
+
+	g_ids.db = nullptr;
+	if (entry.id == 0)
+		return;
+	entry.last_id = static_cast<int>(last_id);
+	entry.comment = std::to_string(last_id - entry.first_id + 1) + " ids reserved";
+	if (g_unusedIds > 0)
+		entry.comment += ", " + std::to_string(g_unusedIds.load()) + " unused after failed saves";
+	if (!db.updateLogAddition(entry))
+		logError("Failed to record ids " + std::to_string(entry.first_id) + "-" + std::to_string(last_id) + " in log_additions.");
+}
 
-void	processSongs(const t_paths &paths, std::vector<cv::Mat> &hashes)
+void	processSongs(const t_paths &paths, const DbConfig &db_config, const t_pipeline &pipeline,
+						const t_imageConfig &image_config, HashStore &hashes, bool backfill)
 {
-	Database db(paths.root + "/songs.db");
+	Database db(paths.root + "/songs.db", db_config);
 
 	if (!db.open()) {
-		std::cerr << "Failed to open database.\n";
+		logError("Failed to open database.");
 		return;
 	}
 
 	if (!db.initSchema()) {
-		std::cerr << "Failed to initialize schema.\n";
+		logError("Failed to initialize schema.");
 		db.close();
 		return;
 	}
 
 	g_NumDbEntries = db.getLastSongId();
+	g_unusedIds = 0;
+	startAdditions(db, g_NumDbEntries);
 
-	db.close();
+	t_fileStates	known;
+	for (FileState &state : db.fetchFileStates()) {
+		std::string key = state.path;
+		known.emplace(std::move(key), std::move(state));
+	}
 
-	const std::vector<std::string> songFiles = getFiles<std::string>(paths.songs, ".mp3");
-	size_t	total = songFiles.size();
+	// Backfill: only songs already in the db that still have no cover
+	std::vector<std::string>	backfillPaths;
+	if (backfill)
+		backfillPaths = db.fetchPathsWithNullCover();
+	// db stays open: reserveId() persists id blocks through it during the run
 
-	log("Found " + std::to_string(total) + " songs in " + paths.songs + ".", true);
-	log("Db entries: " + std::to_string(g_NumDbEntries.load()) + ", diff: " + std::to_string(total - g_NumDbEntries.load()), true);
+	if (backfill)
+		log("Backfilling covers of " + std::to_string(backfillPaths.size()) + " songs...", true);
+	else
+		log("Scanning " + paths.songs + "...", true);
 	g_startTime = std::chrono::steady_clock::now();
 
-	unsigned int				Nthreads = std::thread::hardware_concurrency();
-	if (Nthreads == 0)
-		Nthreads = 4;
-
-	auto hasher = cv::img_hash::PHash::create();
-	std::vector<std::thread> threads;
-	for (unsigned int i = 0; i < Nthreads; ++i)
-	{
-		size_t start = i * (total / Nthreads);
-		size_t end = (i == Nthreads - 1) ? total : start + (total / Nthreads);
-		threads.emplace_back(songsThread, std::ref(songFiles), start, end, std::ref(paths), std::ref(hashes));
-	}
+	// scan -> read -> parse -> image -> encode -> tag write -> db: each stage has
+	// its own threads and bounded queue, so slow disks, TagLib and OpenCV overlap
+	std::atomic<size_t>			total(0);
+	DigestIndex					digests;
+	t_failedCovers				failed;
+	t_songsContext				ctx = {paths, hashes, digests, failed, image_config, known, backfill};
+	BoundedQueue<std::string>	toRead(PIPELINE_QUEUE_SIZE);
+	t_songQueue					toParse(PIPELINE_QUEUE_SIZE);
+	t_songQueue					toImage(PIPELINE_QUEUE_SIZE);
+	t_songQueue					toEncode(PIPELINE_QUEUE_SIZE);
+	t_songQueue					toTagWrite(PIPELINE_QUEUE_SIZE);
+	t_songQueue					toDb(DB_QUEUE_SIZE);
+	std::atomic<unsigned int>	readRunning(pipeline.readThreads);
+	std::atomic<unsigned int>	parseRunning, imageRunning, encodeRunning, tagWriteRunning;
+	std::vector<std::thread>	threads;
+
+	std::unique_ptr<ProgressReporter>	progress(new ProgressReporter(total));
+	std::thread	writer(dbWriterThread, paths.root + "/songs.db", std::cref(db_config), std::ref(toDb));
+	std::thread	scanner([&paths, &pipeline, &total, &toRead, &backfillPaths, backfill]() {
+		if (backfill) {
+			total = backfillPaths.size();
+			for (std::string &path : backfillPaths)
+				pushTraced(toRead, std::move(path));
+		}
+		else {
+			// Songs are processed as soon as they are found instead of after a full walk
+			scanFiles(paths.songs, ".mp3", pipeline.scanThreads, [&total, &toRead](std::string &&path) {
+				total++;
+				pushTraced(toRead, std::move(path));
+			});
+		}
+		toRead.close();
+	});
+	for (unsigned int i = 0; i < pipeline.readThreads; ++i)
+		threads.emplace_back(readThread, std::ref(toRead), std::cref(ctx), std::ref(toParse), std::ref(readRunning));
+	startStage("parse", pipeline.parseThreads, toParse, toImage, parseRunning, []() {
+		return [](t_songJob &job) { return parseSong(job); };
+	}, threads);
+	startStage("image", pipeline.imageThreads, toImage, toEncode, imageRunning, [&ctx]() {
+		return [&ctx](t_songJob &job) { decodeCover(job, ctx); return true; };
+	}, threads);
+	startStage("encode", pipeline.encodeThreads, toEncode, toTagWrite, encodeRunning, [&ctx]() {
+		return [&ctx](t_songJob &job) { saveCover(job, ctx); return true; };
+	}, threads);
+	startStage("tag write", pipeline.tagWriteThreads, toTagWrite, toDb, tagWriteRunning, []() {
+		return [](t_songJob &job) { return writeSongTag(job); };
+	}, threads);
+
+	scanner.join();
 	for (auto &t : threads)
 		t.join();
+	writer.join();
+	progress.reset();
+
+	finishAdditions(db);
+	// Songs matched to a cover before its save failed: leave them for --backfill-covers
+	for (uint32_t id : failed.ids) {
+		if (!db.clearCover(static_cast<int>(id)))
+			logError("Failed to unlink songs from unsaved cover " + std::to_string(id));
+	}
 
-	displayProgress(total, total);
+	if (db_config.bulkLoad) {
+		// Build the indexes deferred by initSchema() once, over the complete data
+		log("Bulk load done, creating indexes...", true);
+		if (!db.createIndexes())
+			logError("Failed to create indexes.");
+	}
+	db.close();
 
 	auto elapsed = std::chrono::steady_clock::now() - g_startTime;
 	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
@@ -264,7 +933,11 @@ void	processSongs(const t_paths &paths, std::vector<cv::Mat> &hashes)
 	std::ostringstream oss;
 	oss << std::fixed << std::setprecision(3) << seconds;
 
-	std::cout << "\n";
+	if (!backfill) {
+		log("Found " + std::to_string(total) + " songs in " + paths.songs + ".", true);
+		// Signed: g_NumDbEntries also counts ids reserved for files whose tag write failed
+		const long long diff = static_cast<long long>(total.load()) - static_cast<long long>(g_NumDbEntries.load());
+		log("Db entries: " + std::to_string(g_NumDbEntries.load()) + ", diff: " + std::to_string(diff), true);
+	}
 	log("Done! Processed " + std::to_string(total) + " songs in " + oss.str() + " seconds.", true);
-	g_progressCount = 0;
 }
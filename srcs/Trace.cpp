@@ -0,0 +1,115 @@
+#include "Trace.hpp"
+#include <cstdio>
+#include <deque>
+#include <vector>
+
+std::atomic<bool>	g_traceEnabled(false);
+
+typedef struct s_traceEvent
+{
+	const char	*name;
+	const char	*category;
+	int64_t		start;
+	int64_t		duration;
+}	t_traceEvent;
+
+/**
+ * @brief Spans of one thread, appended to by that thread only
+ */
+typedef struct s_traceBuffer
+{
+	size_t						tid;
+	const char					*name = nullptr;
+	std::vector<t_traceEvent>	events;
+}	t_traceBuffer;
+
+static std::chrono::steady_clock::time_point	g_traceOrigin;
+static std::mutex								g_traceMutex;	// Taken once per thread, to register its buffer
+static std::deque<t_traceBuffer>				g_traceBuffers;
+
+static t_traceBuffer	&threadBuffer()
+{
+	thread_local t_traceBuffer *buffer = nullptr;
+
+	if (!buffer)
+	{
+		std::lock_guard<std::mutex> lock(g_traceMutex);
+		buffer = &g_traceBuffers.emplace_back();
+		buffer->tid = g_traceBuffers.size();
+		buffer->events.reserve(TRACE_RESERVE_EVENTS);
+	}
+	return *buffer;
+}
+
+void	startTracing()
+{
+	g_traceOrigin = std::chrono::steady_clock::now();
+	g_traceEnabled.store(true);
+}
+
+int64_t	traceNow()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - g_traceOrigin).count();
+}
+
+void	traceRecord(const char *name, const char *category, int64_t start, int64_t end)
+{
+	threadBuffer().events.push_back({name, category, start, end - start});
+}
+
+void	traceThreadName(const char *name)
+{
+	if (g_traceEnabled.load(std::memory_order_relaxed))
+		threadBuffer().name = name;
+}
+
+/**
+ * @brief Write s as a JSON string literal
+ */
+static void	writeJsonString(std::FILE *out, const char *s)
+{
+	std::fputc('"', out);
+	for (; *s; ++s)
+	{
+		if (*s == '"' || *s == '\\')
+			std::fputc('\\', out);
+		if (static_cast<unsigned char>(*s) >= 0x20)
+			std::fputc(*s, out);
+	}
+	std::fputc('"', out);
+}
+
+bool	writeTrace(const std::string &path)
+{
+	std::FILE	*out = std::fopen(path.c_str(), "w");
+	bool		first = true;
+
+	if (!out)
+		return false;
+
+	std::lock_guard<std::mutex> lock(g_traceMutex);
+	std::fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out);
+	for (const t_traceBuffer &buffer : g_traceBuffers)
+	{
+		if (buffer.name)
+		{
+			std::fprintf(out, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":",
+				first ? "" : ",\n", buffer.tid);
+			writeJsonString(out, buffer.name);
+			std::fputs("}}", out);
+			first = false;
+		}
+		for (const t_traceEvent &event : buffer.events)
+		{
+			std::fputs(first ? "{\"ph\":\"X\",\"name\":" : ",\n{\"ph\":\"X\",\"name\":", out);
+			writeJsonString(out, event.name);
+			std::fputs(",\"cat\":", out);
+			writeJsonString(out, event.category);
+			std::fprintf(out, ",\"pid\":1,\"tid\":%zu,\"ts\":%lld,\"dur\":%lld}", buffer.tid,
+				static_cast<long long>(event.start), static_cast<long long>(event.duration));
+			first = false;
+		}
+	}
+	std::fputs("\n]}\n", out);
+	return std::fclose(out) == 0;
+}
@@ -1,8 +1,90 @@
 #include "../includes/Utils.hpp"
+#include "../includes/Logger.hpp"
+#include "../includes/Trace.hpp"
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
 
 static std::mutex	g_coutMutex;
-static std::mutex	g_logMutex;
+static Logger		g_logger(g_logFile, g_coutMutex);
+
+static std::mutex			g_statsRegistryMutex;
+static std::deque<t_stats>	g_threadStats;	// A deque never moves its slots; they outlive their threads
+
+t_stats	&threadStats()
+{
+	thread_local t_stats *slot = nullptr;
+
+	if (!slot)
+	{
+		std::lock_guard<std::mutex> lock(g_statsRegistryMutex);
+		slot = &g_threadStats.emplace_back();
+	}
+	return *slot;
+}
+
+t_statsTotal	sumStats()
+{
+	t_statsTotal	sum = {0, 0, 0, 0, 0, 0};
+
+	std::lock_guard<std::mutex> lock(g_statsRegistryMutex);
+	for (const t_stats &stats : g_threadStats)
+	{
+		sum.processed += stats.processed.load(std::memory_order_relaxed);
+		sum.newFiles += stats.newFiles.load(std::memory_order_relaxed);
+		sum.updatedFiles += stats.updatedFiles.load(std::memory_order_relaxed);
+		sum.newImages += stats.newImages.load(std::memory_order_relaxed);
+		sum.unchanged += stats.unchanged.load(std::memory_order_relaxed);
+		sum.errors += stats.errors.load(std::memory_order_relaxed);
+	}
+	return sum;
+}
+
+ProgressReporter::ProgressReporter(const std::atomic<size_t> &total)
+	: _total(total), _base(sumStats().processed)
+{
+	_thread = std::thread(&ProgressReporter::run, this);
+}
+
+ProgressReporter::~ProgressReporter()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stop = true;
+	}
+	_wake.notify_one();
+	_thread.join();
+
+	size_t total = _total.load();
+	if (total)
+		displayProgress(total, total);
+	// End the bar's line under the lock the logger's console writes take
+	auto lock = traceLock<std::unique_lock<std::mutex> >(g_coutMutex, "console");
+	std::cout << "\n";
+	std::cout.flush();
+}
+
+void	ProgressReporter::run()
+{
+	traceThreadName("progress");
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	displayProgress(0, 1);	// Restarts the ETA estimate
+	while (!_wake.wait_for(lock, std::chrono::milliseconds(PROGRESS_TICK_MS), [this] { return _stop; }))
+	{
+		size_t total = _total.load();
+		size_t current = sumStats().processed - _base;
+		if (total)
+			displayProgress(std::min(current, total), total);
+	}
+}
 
 void	displayProgress(const size_t current, const size_t total)
 {
@@ -13,19 +95,26 @@ void	displayProgress(const size_t current, const size_t total)
 	static auto		startTime = std::chrono::steady_clock::now();
 	static auto		lastTime = startTime;
 	static float	lastPercent = -1.0f;
+	static int		remMin = 0;
+	static int		remSec = 0;
 
 	static std::deque<long long>	durationList;
 	static const size_t				maxPoints = 50;
 
 	auto now = std::chrono::steady_clock::now();
 
-	if (current == 0 || percent < lastPercent)
+	if (current == 0)
 	{
 		startTime = now;
 		lastTime = now;
 		lastPercent = -1.0f;
+		remMin = 0;
+		remSec = 0;
 		durationList.clear();
+		return;
 	}
+	if (percent < lastPercent)
+		lastPercent = percent; // total grew while the scan streams in: keep the timings, count steps from here
 	else if (percent - lastPercent >= 0.1f)
 	{
 		auto durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(now - lastTime).count();
@@ -49,61 +138,50 @@ void	displayProgress(const size_t current, const size_t total)
 		int	remainingPoints = (int)((1000.0f - percentPoints) + 0.5f);
 		long long remainingMs = (long long)(weightedAvg * remainingPoints);
 
-		int	remMin = (int)(remainingMs / 1000 / 60);
-		int	remSec = (int)((remainingMs / 1000) % 60);
+		remMin = (int)(remainingMs / 1000 / 60);
+		remSec = (int)((remainingMs / 1000) % 60);
 
 		lastPercent = percent;
+	}
 
-		std::lock_guard<std::mutex> lock(g_coutMutex);
-		
-		std::cout << "\r\033[K";
-		std::cout << current << "/" << total << " "
-				  << remMin << ":" << (remSec < 10 ? "0" : "") << remSec << " [";
-		for (int i = 0; i < PROGRESS_BAR_WIDTH; ++i)
-			std::cout << (i <= pos ? '#' : '-');
-		std::cout << "] ";
-		{
-			std::lock_guard<std::mutex> stats_lock(g_statsMutex);
-			std::cout << std::fixed << std::setprecision(1)
-					  << percent << " % | new: " << g_stats.newFiles
-					  << ", updated: "  << g_stats.updatedFiles
-					  << ", images: "   << g_stats.newImages
-					  << ", errors: "   << g_stats.errors;
-		}
+	t_statsTotal stats = sumStats();
+	auto lock = traceLock<std::unique_lock<std::mutex> >(g_coutMutex, "console");
 
-		std::cout.flush();
-	}
+	std::cout << "\r\033[K";
+	std::cout << current << "/" << total << " "
+			  << remMin << ":" << (remSec < 10 ? "0" : "") << remSec << " [";
+	for (int i = 0; i < PROGRESS_BAR_WIDTH; ++i)
+		std::cout << (i <= pos ? '#' : '-');
+	std::cout << "] ";
+	std::cout << std::fixed << std::setprecision(1)
+			  << percent << " % | new: " << stats.newFiles
+			  << ", updated: "  << stats.updatedFiles
+			  << ", images: "   << stats.newImages
+			  << ", unchanged: " << stats.unchanged
+			  << ", errors: "   << stats.errors;
+
+	std::cout.flush();
 }
 
 
 void	log(std::string message, bool console)
 {
-	std::chrono::system_clock::time_point	now_sys = std::chrono::system_clock::now();
-	std::time_t								now_c = std::chrono::system_clock::to_time_t(now_sys);
-	std::tm									local_tm;
-
-	localtime_r(&now_c, &local_tm);
+	g_logger.write(Logger::INFO, std::move(message), console);
+}
 
-	std::chrono::duration<double>			time_span = now_sys.time_since_epoch();
-	long									ms = std::chrono::duration_cast<std::chrono::milliseconds>(time_span).count() % 1000;
+void	logError(std::string message)
+{
+	g_logger.write(Logger::ERROR, std::move(message), false);
+}
 
-	std::ostringstream oss;
-	oss << "[" << std::setfill('0')
-		<< std::setw(2) << local_tm.tm_hour << ":"
-		<< std::setw(2) << local_tm.tm_min << ":"
-		<< std::setw(2) << local_tm.tm_sec << "."
-		<< std::setw(3) << ms << "] " << message << "\n";
+void	startLogger()
+{
+	g_logger.start();
+}
 
-	{
-		std::lock_guard<std::mutex> lock(g_logMutex);
-		if (g_logFile.is_open())
-			g_logFile << oss.str();
-	{
-		std::lock_guard<std::mutex> cout_lock(g_coutMutex);
-		if (console)
-			std::cout << oss.str();
-	}
-	}
+void	stopLogger()
+{
+	g_logger.stop();
 }
 
 /**
@@ -157,6 +235,133 @@ t_paths	getPathsFromEnv(const std::string &env_path)
 	return paths;
 }
 
+/**
+ * @brief Read an integer setting, falling back to def when missing or invalid
+ */
+static long long	getEnvNumber(const std::string &filepath, const std::string &key, long long def)
+{
+	std::string	value = getEnvVar(filepath, key);
+	size_t		end = 0;
+	long long	n = def;
+
+	if (value.empty())
+		return def;
+	try {
+		n = std::stoll(value, &end);
+	}
+	catch (const std::exception &) {
+		end = 0;
+	}
+	if (end != value.size())
+	{
+		std::cerr << "Invalid " << key << "=" << value << ", using " << def << "\n";
+		return def;
+	}
+	return n;
+}
+
+/**
+ * @brief Read an uppercased keyword setting, falling back to def unless it is one of allowed
+ */
+static std::string	getEnvKeyword(const std::string &filepath, const std::string &key,
+									const std::vector<std::string> &allowed, const std::string &def)
+{
+	std::string	value = getEnvVar(filepath, key);
+
+	if (value.empty())
+		return def;
+	for (char &c : value)
+		c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+	for (const std::string &a : allowed)
+	{
+		if (value == a)
+			return value;
+	}
+	std::cerr << "Invalid " << key << "=" << value << ", using " << def << "\n";
+	return def;
+}
+
+DbConfig	getDbConfigFromEnv(const std::string &env_path)
+{
+	DbConfig	config;
+
+	config.journalMode = getEnvKeyword(env_path, "SQLITE_JOURNAL_MODE",
+		{"DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF"}, config.journalMode);
+	config.synchronous = getEnvKeyword(env_path, "SQLITE_SYNCHRONOUS",
+		{"OFF", "NORMAL", "FULL", "EXTRA"}, config.synchronous);
+	config.mmapSize = getEnvNumber(env_path, "SQLITE_MMAP_SIZE", config.mmapSize);
+	config.cacheSize = getEnvNumber(env_path, "SQLITE_CACHE_SIZE", config.cacheSize);
+	config.pageSize = static_cast<int>(getEnvNumber(env_path, "SQLITE_PAGE_SIZE", config.pageSize));
+	config.busyTimeout = static_cast<int>(getEnvNumber(env_path, "SQLITE_BUSY_TIMEOUT", config.busyTimeout));
+	config.bulkLoad = getEnvNumber(env_path, "SQLITE_BULK_LOAD", 0) != 0;
+	return config;
+}
+
+static unsigned int	getEnvThreads(const std::string &filepath, const std::string &key, unsigned int def)
+{
+	long long	n = getEnvNumber(filepath, key, def);
+
+	if (n < 1)
+	{
+		std::cerr << key << " must be at least 1, using " << def << "\n";
+		return def;
+	}
+	return static_cast<unsigned int>(n);
+}
+
+t_pipeline	getPipelineFromEnv(const std::string &env_path)
+{
+	unsigned int	cores = std::thread::hardware_concurrency();
+	t_pipeline		pipeline;
+
+	if (cores == 0)
+		cores = 4;
+	// Decoding and hashing covers dominates; reads and tag writes are I/O bound
+	pipeline.scanThreads = getEnvThreads(env_path, "SCAN_THREADS", 4);
+	pipeline.readThreads = getEnvThreads(env_path, "READ_THREADS", 2);
+	pipeline.parseThreads = getEnvThreads(env_path, "PARSE_THREADS", std::max(1u, cores / 2));
+	pipeline.imageThreads = getEnvThreads(env_path, "IMAGE_THREADS", cores);
+	pipeline.encodeThreads = getEnvThreads(env_path, "ENCODE_THREADS", std::max(1u, cores / 4));
+	pipeline.tagWriteThreads = getEnvThreads(env_path, "TAGWRITE_THREADS", 2);
+	return pipeline;
+}
+
+t_imageConfig	getImageConfigFromEnv(const std::string &env_path)
+{
+	t_imageConfig	config;
+	std::string		kernel = getEnvKeyword(env_path, "RESIZE_KERNEL", {"AREA", "CUBIC", "LANCZOS"}, "LANCZOS");
+
+	if (kernel == "AREA")
+		config.resizeKernel = cv::INTER_AREA;
+	else if (kernel == "CUBIC")
+		config.resizeKernel = cv::INTER_CUBIC;
+	else
+		config.resizeKernel = cv::INTER_LANCZOS4;
+	return config;
+}
+
+uint64_t	coverHash(const cv::Mat &image)
+{
+	cv::Mat	thumb;
+	cv::Mat	gray;
+
+	// PHash's own order and kernel: resize, then convert only the 32x32 pixels
+	cv::resize(image, thumb, cv::Size(PHASH_THUMB_SIZE, PHASH_THUMB_SIZE), 0, 0, cv::INTER_LINEAR_EXACT);
+	if (thumb.channels() > 1)
+		cv::cvtColor(thumb, gray, cv::COLOR_BGR2GRAY);
+	else
+		gray = thumb;
+	return perceptualHash(gray.ptr<uint8_t>(0), gray.step);
+}
+
+std::string	coverPath(uint64_t hash)
+{
+	char	name[32];
+
+	std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+	return std::string(name, 2) + "/" + std::string(name + 2, 2) + "/" + name + ".jpg";
+}
+
 void	redirectStderrToFile(const std::string &filepath)
 {
 	int	fd = open(filepath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
@@ -165,3 +370,133 @@ void	redirectStderrToFile(const std::string &filepath)
 	else
 		std::cerr << "Failed to redirect stderr to " << filepath << "\n";
 }
+
+/**
+ * @brief Directories left to read by scanFiles(), shared by its threads
+ */
+typedef struct s_scanState
+{
+	std::mutex					mutex;
+	std::condition_variable		ready;
+	std::vector<std::string>	dirs;
+	size_t						pending;	// Directories queued or being read
+}	t_scanState;
+
+typedef struct s_linuxDirent64
+{
+	ino64_t			d_ino;
+	off64_t			d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char			d_name[];
+}	t_linuxDirent64;
+
+static bool	hasExtension(const char *name, size_t len, const std::string &extension)
+{
+	return len > extension.size() && extension.compare(0, std::string::npos, name + len - extension.size()) == 0;
+}
+
+/**
+ * @brief Read one directory, queueing its subdirectories and reporting matching files
+ */
+static void	scanDirectory(const std::string &dir, const std::string &extension, t_scanState &state,
+							const std::function<void(std::string &&)> &on_file, std::vector<char> &buf)
+{
+	int			fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	long		n;
+	struct stat	st;
+	TRACE_SPAN("readdir");
+
+	if (fd < 0)
+	{
+		logError("Filesystem error: cannot open " + dir + ": " + std::strerror(errno));
+		return;
+	}
+	while ((n = syscall(SYS_getdents64, fd, buf.data(), buf.size())) > 0)
+	{
+		for (long pos = 0; pos < n;)
+		{
+			const t_linuxDirent64	*entry = reinterpret_cast<const t_linuxDirent64 *>(buf.data() + pos);
+			const char				*name = entry->d_name;
+			unsigned char			type = entry->d_type;
+
+			pos += entry->d_reclen;
+			if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+				continue;
+			if (type == DT_UNKNOWN)
+			{
+				// Not reported by the file system: lstat decides whether to descend
+				if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+					continue;
+				type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+			}
+			if (type == DT_LNK)
+			{
+				// Symlinks count as what they point to, but only for files
+				if (fstatat(fd, name, &st, 0) != 0)
+					continue;
+				type = S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+			}
+			if (type == DT_DIR)
+			{
+				auto lock = traceLock<std::unique_lock<std::mutex> >(state.mutex, "scan queue");
+				state.dirs.push_back(dir + "/" + name);
+				state.pending++;
+				state.ready.notify_one();
+			}
+			else if (type == DT_REG && hasExtension(name, std::strlen(name), extension))
+				on_file(dir + "/" + name);
+		}
+	}
+	if (n < 0)
+		logError("Filesystem error: cannot read " + dir + ": " + std::strerror(errno));
+	close(fd);
+}
+
+static void	scanThread(const std::string &extension, t_scanState &state, const std::function<void(std::string &&)> &on_file)
+{
+	std::vector<char>	buf(SCAN_BUFFER_SIZE);
+	std::string			dir;
+
+	traceThreadName("scan");
+	for (;;)
+	{
+		{
+			auto lock = traceLock<std::unique_lock<std::mutex> >(state.mutex, "scan queue");
+			state.ready.wait(lock, [&state]() { return !state.dirs.empty() || state.pending == 0; });
+			if (state.dirs.empty())
+				return;
+			// Depth first keeps the stack of queued directories small
+			dir = std::move(state.dirs.back());
+			state.dirs.pop_back();
+		}
+		scanDirectory(dir, extension, state, on_file, buf);
+		{
+			auto lock = traceLock<std::unique_lock<std::mutex> >(state.mutex, "scan queue");
+			if (--state.pending == 0)
+				state.ready.notify_all();
+		}
+	}
+}
+
+void	scanFiles(const std::string &start_path, const std::string &extension, unsigned int threads,
+					const std::function<void(std::string &&)> &on_file)
+{
+	t_scanState					state;
+	std::vector<std::thread>	workers;
+	std::error_code				ec;
+
+	if (!std::filesystem::exists(start_path, ec) && !ec)
+	{
+		// Nothing to scan yet: create it so the next run finds it
+		if (!std::filesystem::create_directories(start_path, ec))
+			logError("Failed to create directory: " + start_path + (ec ? ": " + ec.message() : ""));
+		return;
+	}
+	state.dirs.push_back(start_path);
+	state.pending = 1;
+	for (unsigned int i = 0; i < std::max(1u, threads); ++i)
+		workers.emplace_back(scanThread, std::cref(extension), std::ref(state), std::cref(on_file));
+	for (auto &t : workers)
+		t.join();
+}
@@ -1,41 +1,210 @@
 #include "../includes/Utils.hpp"
 #include "../includes/Database.hpp"
+#include "../includes/HashIndex.hpp"
+#include "../includes/HashStore.hpp"
+#include "../includes/Trace.hpp"
+#include <cctype>
+#include <unordered_set>
+#include <sys/stat.h>
 
 std::chrono::steady_clock::time_point	g_startTime;
-std::atomic<size_t>						g_progressCount(0);
 std::ofstream							g_logFile;
 
-static std::vector<cv::Mat>	processImages(const std::string &img_dir)
+typedef struct s_imageResult
 {
-	std::vector<cv::String> imgFiles = getFiles<cv::String>(img_dir, ".jpg");
-	size_t	total = imgFiles.size();
+	t_hashEntry	entry;
+	bool		valid;
+}	t_imageResult;
 
-	if (total == 0)
+/**
+ * @brief Numeric id of a cover image named "<id>.jpg", or 0 for any other name
+ */
+static uint32_t	imageId(const std::string &path)
+{
+	const std::string	stem = std::filesystem::path(path).stem().string();
+	char				*end = nullptr;
+	unsigned long		id;
+
+	if (stem.empty() || !std::isdigit(static_cast<unsigned char>(stem[0])))
+		return 0;
+	id = std::strtoul(stem.c_str(), &end, 10);
+	if (*end != '\0' || id > UINT32_MAX)
+		return 0;
+	return static_cast<uint32_t>(id);
+}
+
+/**
+ * @brief Worker hashing images claimed from a shared cursor.
+ *
+ * Each result is written to its file's slot so the merge keeps directory order
+ * regardless of which thread finished first. The index is only read here.
+ */
+static void	imagesThread(const std::vector<cv::String> &imgFiles, const HashIndex &index,
+							std::atomic<size_t> &cursor, std::vector<t_imageResult> &results)
+{
+	cv::Mat		img;
+	struct stat	st;
+	size_t		i;
+
+	traceThreadName("migrate");
+	while ((i = cursor++) < imgFiles.size())
 	{
-		log("No images found in " + img_dir + ".", true);
-		return {};
+		const cv::String	&f = imgFiles[i];
+		t_imageResult		&res = results[i];
+
+		res.valid = false;
+		if (stat(f.c_str(), &st) != 0)
+			logError("failed to stat " + f);
+		else
+		{
+			res.entry.size = static_cast<uint64_t>(st.st_size);
+			res.entry.mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+
+			const t_hashEntry *cached = index.lookup(f, res.entry.size, res.entry.mtime);
+			if (cached)
+			{
+				res.entry = *cached;
+				res.valid = true;
+			}
+			else
+			{
+				{
+					TRACE_SPAN("imread");
+					img = cv::imread(f, cv::IMREAD_GRAYSCALE);
+				}
+				if (img.empty())
+					logError("failed to load " + f);
+				else
+				{
+					TRACE_SPAN("phash");
+					res.entry.hash = coverHash(img);
+					res.valid = true;
+				}
+			}
+		}
+		addStat(threadStats().processed);
 	}
+}
+
+/**
+ * @brief Cover images still stored flat as IMG_DIR/<id>.jpg by earlier versions
+ */
+static std::vector<cv::String>	legacyImages(const std::string &img_dir)
+{
+	std::vector<cv::String>	result;
+	std::error_code			ec;
 
-	log("Generating perceptual hashes for " + std::to_string(total) + " images...", true);
+	for (std::filesystem::directory_iterator it(img_dir, ec), end; !ec && it != end; it.increment(ec))
+	{
+		if (it->is_regular_file(ec) && it->path().extension() == ".jpg" && imageId(it->path().string()) != 0)
+			result.push_back(it->path().string());
+	}
+	return result;
+}
+
+/**
+ * @brief Move flat IMG_DIR/<id>.jpg covers into the sharded store and record them in songs.db.
+ *
+ * Hashes are cached in ROOT_DIR/phash.idx keyed by path, size and mtime, so an
+ * interrupted migration does not decode the same images again. Decoding and
+ * hashing run on all cores. The covers rows are then committed, and only then
+ * are the files moved, in directory order. An image whose hash is already
+ * stored is not moved over the existing file: its id gets a row pointing at that
+ * file, and the image is deleted.
+ */
+static void	migrateLegacyImages(const t_paths &paths, Database &db, HashStore &hashes)
+{
+	const std::string		&img_dir = paths.images;
+	std::vector<cv::String>	imgFiles = legacyImages(img_dir);
+	size_t	total = imgFiles.size();
+
+	if (total == 0)
+		return;
+
+	HashIndex	index(paths.root + "/phash.idx");
+	index.load();
+
+	log("Migrating " + std::to_string(total) + " images to the sharded cover store ("
+		+ std::to_string(index.loadedCount()) + " cached)...", true);
 	g_startTime = std::chrono::steady_clock::now();
 
-	cv::Mat img, hash;
-	auto hasher = cv::img_hash::PHash::create();
-	std::vector<cv::Mat> hashes;
+	unsigned int	Nthreads = std::thread::hardware_concurrency();
+	if (Nthreads == 0)
+		Nthreads = 4;
 
-	for (auto &f : imgFiles)
+	std::vector<t_imageResult>	results(total);
+	std::atomic<size_t>			cursor(0);
+	std::vector<std::thread>	threads;
 	{
-		img = cv::imread(f, cv::IMREAD_GRAYSCALE);
-		if (img.empty())
+		const std::atomic<size_t>	progressTotal(total);
+		ProgressReporter			progress(progressTotal);
+
+		for (unsigned int i = 0; i < Nthreads; ++i)
+			threads.emplace_back(imagesThread, std::cref(imgFiles), std::cref(index), std::ref(cursor), std::ref(results));
+		for (auto &t : threads)
+			t.join();
+	}
+
+	// Rows are committed before any file moves: a failed or interrupted run leaves
+	// the images flat, and the next run migrates them again
+	std::vector<CoverRecord>		covers;
+	std::vector<size_t>				sources;	// Index in imgFiles of each entry of covers
+	std::vector<bool>				duplicate;	// Its cover path was already taken: link, don't move
+	std::unordered_set<std::string>	targets;
+
+	db.beginTransaction();
+	for (size_t i = 0; i < total; ++i)
+	{
+		if (!results[i].valid)
+			continue;
+		index.update(imgFiles[i], results[i].entry);
+
+		CoverRecord		cover = {static_cast<int>(imageId(imgFiles[i])), results[i].entry.hash, coverPath(results[i].entry.hash)};
+		std::error_code	ec;
+		// Same hash as an image moved earlier: its id points at that file instead of replacing it
+		const bool		taken = targets.count(cover.path) != 0 || std::filesystem::exists(img_dir + "/" + cover.path, ec);
+
+		if (!db.insertCover(cover))
 		{
-			std::cerr << "failed to load " << f << "\n";
+			logError("Failed to record cover " + imgFiles[i]);
 			continue;
 		}
-		hasher->compute(img, hash);
-		hashes.push_back(hash.clone());
-		displayProgress(g_progressCount++, total);
+		targets.insert(cover.path);
+		covers.push_back(std::move(cover));
+		sources.push_back(i);
+		duplicate.push_back(taken);
+	}
+	if (!db.commitTransaction())
+	{
+		db.rollbackTransaction();
+		logError("Failed to record migrated covers, images left in place.");
+		covers.clear();
 	}
-	displayProgress(total, total);
+
+	for (size_t c = 0; c < covers.size(); ++c)
+	{
+		const std::string	&source = imgFiles[sources[c]];
+		const std::string	target = img_dir + "/" + covers[c].path;
+		std::error_code		ec;
+
+		// Every committed id is taken, even if its file stays behind for the next run
+		hashes.push(covers[c].hash, static_cast<uint32_t>(covers[c].id));
+		if (duplicate[c])
+			continue;
+		std::filesystem::create_directories(std::filesystem::path(target).parent_path(), ec);
+		std::filesystem::rename(source, target, ec);
+		if (ec)
+			logError("Failed to move " + source + ": " + ec.message());
+	}
+	// Duplicates go last: only dropped once the file they now point at is in place
+	for (size_t c = 0; c < covers.size(); ++c)
+	{
+		std::error_code	ec;
+
+		if (duplicate[c] && std::filesystem::exists(img_dir + "/" + covers[c].path, ec))
+			std::filesystem::remove(imgFiles[sources[c]], ec);
+	}
+	index.save();
 
 	auto elapsed = std::chrono::steady_clock::now() - g_startTime;
 	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
@@ -44,27 +213,88 @@ static std::vector<cv::Mat>	processImages(const std::string &img_dir)
 	std::ostringstream oss;
 	oss << std::fixed << std::setprecision(3) << seconds;
 
-	std::cout << "\n";
-	log("Done! Processed " + std::to_string(total) + " images in " + oss.str() + " seconds.", true);
-	g_progressCount = 0;
-	return hashes;
+	log("Done! Migrated " + std::to_string(total) + " images in " + oss.str() + " seconds.", true);
+}
+
+/**
+ * @brief Load the perceptual hash of every known cover from songs.db.
+ *
+ * The covers table maps each cover id to its hash and its path in the sharded
+ * store, so no image has to be listed or decoded at startup. Covers left in the
+ * flat layout of earlier versions are migrated first.
+ */
+static bool	loadCovers(const t_paths &paths, const DbConfig &db_config, HashStore &hashes)
+{
+	Database	db(paths.root + "/songs.db", db_config);
+
+	if (!db.open() || !db.initSchema())
+	{
+		logError("Failed to open database.");
+		return false;
+	}
+
+	std::vector<CoverRecord>	covers = db.fetchCovers();
+	hashes.reserve(covers.size());
+	for (const CoverRecord &cover : covers)
+		hashes.push(cover.hash, static_cast<uint32_t>(cover.id));
+	// A crash can leave songs linked to an id whose covers row was never committed
+	hashes.skipIds(db.getLastCoverId());
+	log("Loaded " + std::to_string(covers.size()) + " covers from songs.db.", true);
+
+	migrateLegacyImages(paths, db, hashes);
+	db.close();
+	return true;
 }
 
 int	main(int argc, char **argv)
 {
-	(void)argc;
-	(void)argv;
+	bool		backfill = false;
+	std::string	tracePath;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string	arg(argv[i]);
+
+		if (arg == "--backfill-covers")
+			backfill = true;
+		else if (arg.compare(0, 8, "--trace=") == 0 && arg.size() > 8)
+			tracePath = arg.substr(8);
+		else
+		{
+			std::cerr << "Usage: " << argv[0] << " [--backfill-covers] [--trace=<file.json>]\n";
+			return 1;
+		}
+	}
+	if (!tracePath.empty())
+	{
+		startTracing();
+		traceThreadName("main");
+	}
 
 	g_logFile.open("info.log", std::ios::app);
 	if (!g_logFile.is_open())
 		std::cerr << "Failed to open log file\n";
 
-	t_paths	paths = getPathsFromEnv(".env");
+	t_paths		paths = getPathsFromEnv(".env");
+	DbConfig	dbConfig = getDbConfigFromEnv(".env");
+	t_pipeline	pipeline = getPipelineFromEnv(".env");
+	t_imageConfig	imageConfig = getImageConfigFromEnv(".env");
 	redirectStderrToFile("errors.log");
+	startLogger();
 
-	std::vector<cv::Mat> hashes = processImages(paths.images);
-	processSongs(paths, hashes);
+	HashStore hashes(HAMMING_THRESHOLD);
+	if (loadCovers(paths, dbConfig, hashes))
+		processSongs(paths, dbConfig, pipeline, imageConfig, hashes, backfill);
 
+	stopLogger();
+	// Every traced thread is joined by now, the logger's included
+	if (!tracePath.empty())
+	{
+		if (writeTrace(tracePath))
+			log("Trace written to " + tracePath + ".", true);
+		else
+			std::cerr << "Failed to write trace " << tracePath << "\n";
+	}
 	if (g_logFile.is_open())
 		g_logFile.close();
 